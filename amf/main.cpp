@@ -15,6 +15,19 @@
 #include <fcntl.h>
 #include <dlfcn.h>
 #include <memory>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+#include <emmintrin.h>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <cwchar>
+#include <cctype>
+#include <unordered_map>
 #include "wine/debug.h"
 #include "winecompat.h"
 #include "iconv.h"
@@ -360,19 +373,60 @@ foundProp:
 	p_vkDestroyImage(device, dstImage, nullptr);
 }
 
-// This only works if we assume str is actually ASCII. It asserts on that
-// though.
-char32_t* winWStrToLinux(const char16_t *str) {
-	size_t len = 0; //Includes trailing null
-	do {
-		// Check that all characters are in the ASCII set
-		assert((str[len] & 0xFF00) == 0);
-	} while(str[len++] != 0);
+// Property and component names come in as UTF-16 but AMF wants wchar_t,
+// which is UTF-32 on our side. The encoder passes the same handful of names
+// every frame, so each one is translated once and kept around for good. The
+// pointer we hand out is stable, so it can be used as a key too.
+static std::shared_mutex internLock;
+static std::unordered_map<std::u16string_view, const wchar_t*> internTable;
+
+// Zero extends 8 characters at a time. A surrogate would need a real
+// decode, but the names are all ASCII so we just check there isn't one.
+static void widenWStr(wchar_t *dst, const char16_t *src, size_t len) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i surrogateMask = _mm_set1_epi16((short)0xF800);
+	const __m128i surrogate = _mm_set1_epi16((short)0xD800);
+	__m128i bad = zero;
+	size_t i = 0;
+	for(; i + 8 <= len; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi16(_mm_and_si128(v, surrogateMask), surrogate));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(v, zero));
+		_mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(v, zero));
+	}
+	assert(_mm_movemask_epi8(bad) == 0);
+	for(; i < len; i++) {
+		assert((src[i] & 0xF800) != 0xD800);
+		dst[i] = src[i];
+	}
+	dst[len] = 0;
+}
 
-	char32_t *buf = (char32_t*)malloc(len * sizeof(char32_t));
-	
-	while((*(buf++) = (char32_t)*(str++)) != 0);
-	return (char32_t*)(buf - (len));
+const wchar_t* internWinWStr(const char16_t *str) {
+	std::u16string_view key(str);
+	{
+		std::shared_lock lock(internLock);
+		auto it = internTable.find(key);
+		if(it != internTable.end()) return it->second;
+	}
+
+	ZoneScopedN("InternMiss");
+	std::unique_lock lock(internLock);
+	// Someone might have beaten us to it
+	auto it = internTable.find(key);
+	if(it != internTable.end()) return it->second;
+
+	// The key has to outlive the caller's string. Both halves live in one
+	// allocation that's never freed.
+	size_t len = key.size();
+	// Rounded up so the wide half is aligned
+	size_t winSize = (len + 2) & ~(size_t)1;
+	char16_t *winCopy = (char16_t*)malloc(winSize * sizeof(char16_t) + (len + 1) * sizeof(wchar_t));
+	wchar_t *linuxName = (wchar_t*)(winCopy + winSize);
+	memcpy(winCopy, str, (len + 1) * sizeof(char16_t));
+	widenWStr(linuxName, str, len);
+	internTable.emplace(std::u16string_view(winCopy, len), linuxName);
+	return linuxName;
 }
 
 char16_t* linuxWStrToWin(const char32_t *str) {
@@ -390,6 +444,14 @@ char16_t* linuxWStrToWin(const char32_t *str) {
 
 class AMFBufferImpl;
 
+// One line from the policy file, see loadPolicy
+struct PolicyRule {
+	// Interned
+	const wchar_t *name;
+	enum { Force, AtMost, AtLeast } op;
+	amf::AMFVariantStruct value;
+};
+
 class AMFInterfaceImpl {
 	std::shared_ptr<amf::AMFInterface> inner;
 
@@ -398,6 +460,11 @@ public:
 
 	AMFInterfaceImpl(std::shared_ptr<amf::AMFInterface> inner) : inner(inner) {};
 
+	// Pooled wrappers count their own references. They hold one on the host
+	// object until the last one goes, and then go back to their pool.
+	std::atomic<amf_long> refs = 1;
+	void (*recycle)(AMFInterfaceImpl *obj) = nullptr;
+
 	MSABI virtual amf_long Acquire();
 	MSABI virtual amf_long Release();
 	MSABI virtual AMF_RESULT QueryInterface(const amf::AMFGuid& interfaceID, void** ppInterface);
@@ -406,6 +473,20 @@ public:
 class AMFPropertyStorageImpl : AMFInterfaceImpl {
 	std::shared_ptr<amf::AMFPropertyStorage> inner;
 
+protected:
+	// What we last set, keyed by the interned name. Only plain values go in
+	// here, strings and interfaces always go to the host.
+	bool cacheProperties = false;
+	mutable std::mutex propertiesLock;
+	std::unordered_map<const wchar_t*, amf::AMFVariantStruct> properties;
+	// What the policy file says about this object's properties
+	std::vector<PolicyRule> policy;
+
+	void clearProperties() {
+		std::unique_lock lock(propertiesLock);
+		properties.clear();
+	}
+
 public:
 	AMF_DECLARE_IID(0xc7cec05b, 0xcfb9, 0x48af, 0xac, 0xe3, 0xf6, 0x8d, 0xf8, 0x39, 0x5f, 0xe3)
 
@@ -450,15 +531,45 @@ public:
 	MSABI virtual amf_pts GetDuration();
 };
 
+class AMFContextImpl;
+
+static const size_t MaxSurfaceObservers = 8;
+
+class AMFSurfaceImpl;
+
+// One per DX11 texture the driver has given us. The context keeps these in
+// its cache and hands out the same surface every time the texture comes
+// back, see CreateSurfaceFromDX11Native.
+struct SharedTexture {
+	ID3D11Texture2D *texture;
+	amf::AMFVulkanSurface vulkan;
+	// The host surface made from the import and our wrapper around it. The
+	// cache holds a reference to the wrapper, which holds the host surface.
+	amf::AMFSurface *host;
+	AMFSurfaceImpl *surface;
+	uint64_t lastUse;
+	// One for the cache and one for the host surface until the host lets go
+	// of it
+	uint32_t refs;
+};
+
 class AMFSurfaceImpl : AMFDataImpl {
 
 public:
 	AMF_DECLARE_IID(0x3075dbe3, 0x8718, 0x4cfa, 0x86, 0xfb, 0x21, 0x14, 0xc0, 0xa5, 0xa4, 0x51)
 	std::shared_ptr<amf::AMFSurface> inner;
-	std::unique_ptr<amf::AMFVulkanSurface> surface;
-	std::unique_ptr<ID3D11Texture2D> d3dTexture;
-
-	AMFSurfaceImpl(std::shared_ptr<amf::AMFSurface> inner, std::unique_ptr<amf::AMFVulkanSurface> surface, std::unique_ptr<ID3D11Texture2D> interop) : inner(inner), AMFDataImpl(inner), surface(std::move(surface)), d3dTexture(std::move(interop)) {};
+	SharedTexture *shared = nullptr;
+	// The context that owns the surface's semaphore
+	AMFContextImpl *context = nullptr;
+	// The driver's observers, they hear from the encoder's output path when
+	// it's done with a submission
+	std::mutex observersLock;
+	amf::AMFSurfaceObserver *observers[MaxSurfaceObservers];
+	size_t observerCount = 0;
+	// Submitted and the encoder hasn't produced its output yet
+	std::atomic<bool> inEncoder = false;
+
+	AMFSurfaceImpl(std::shared_ptr<amf::AMFSurface> inner) : inner(inner), AMFDataImpl(inner) {};
 
 	MSABI virtual amf::AMF_SURFACE_FORMAT GetFormat();
 
@@ -474,18 +585,68 @@ public:
 
 	MSABI virtual void AddObserver(amf::AMFSurfaceObserver* pObserver);
 	MSABI virtual void RemoveObserver(amf::AMFSurfaceObserver* pObserver);
+
+	void notifyReleased();
 };
 
+static const size_t SurfaceCacheSize = 8;
+
 class AMFContextImpl : AMFPropertyStorageImpl {
 	std::unique_ptr<amf::AMFVulkanDevice> device;
+
+	// The driver cycles through a few textures, so each one is imported and
+	// wrapped once and handed out again every time it comes back. We hold a
+	// reference to the texture while it's in here so the pointer can't be
+	// reused.
+	std::mutex surfacesLock;
+	std::unordered_map<ID3D11Texture2D*, SharedTexture*> surfaces;
+	uint64_t surfaceUses = 0;
+
+	// Handed to the host with every surface we make. The host calls it when
+	// the surface is destroyed, after the cache dropped it and the encoder
+	// is done with it, so the import can go.
+	class SurfaceBridge : public amf::AMFSurfaceObserver {
+	public:
+		AMFContextImpl *context;
+		void AMF_STD_CALL OnSurfaceDataRelease(amf::AMFSurface* pSurface) override;
+	} surfaceBridge;
+	std::mutex liveLock;
+	// The import under every host surface that's still around
+	std::vector<std::pair<amf::AMFSurface*, SharedTexture*>> liveSurfaces;
+	// The ones the host destroyed on one of its own threads
+	std::vector<SharedTexture*> releasedTextures;
+
+	// What we need to hand textures from dxvk's queue over to the encoder
+	IDXGIVkInteropDevice *dxvkDevice = nullptr;
+	VkQueue dxvkQueue = VK_NULL_HANDLE;
+	PFN_vkCreateSemaphore p_vkCreateSemaphore = nullptr;
+	PFN_vkDestroySemaphore p_vkDestroySemaphore = nullptr;
+	PFN_vkQueueSubmit p_vkQueueSubmit = nullptr;
+
+	AMF_RESULT importDX11Texture(ID3D11Texture2D *dx11Texture, SharedTexture **ppShared);
+	AMF_RESULT wrapTexture(SharedTexture *shared);
+	// Drops the cache's references, the host surface and import stay until
+	// the encoder is done with them. Not with surfacesLock held.
+	void evictTexture(SharedTexture *shared);
+	// Takes surfacesLock
+	void unrefTexture(SharedTexture *shared);
 public:
 	// This is a little hack
 	std::shared_ptr<amf::AMFContext1> inner;
 
-	AMFContextImpl(std::shared_ptr<amf::AMFContext1> inner) : inner(inner), AMFPropertyStorageImpl(inner) {};
+	AMFContextImpl(std::shared_ptr<amf::AMFContext1> inner) : inner(inner), AMFPropertyStorageImpl(inner) {
+		surfaceBridge.context = this;
+	};
 
 	AMF_DECLARE_IID(0xd9e9f868, 0x6220, 0x44c6, 0xa2, 0x2f, 0x7c, 0xd6, 0xda, 0xc6, 0x86, 0x46)
 
+	// Makes the surface's semaphore signal once dxvk is done with everything
+	// it has recorded so far
+	void signalSurface(AMFSurfaceImpl *surface);
+	// Frees the imports of the host surfaces destroyed while we couldn't
+	// call into dxvk. Only on a wine thread.
+	void collectReleased();
+
 	// Cleanup
 	MSABI virtual AMF_RESULT Terminate();
 
@@ -601,13 +762,77 @@ public:
 	MSABI virtual AMF_RESULT GetOutputCaps(amf::AMFIOCaps** output);
 };
 
+static const amf_int64 DrainQueryTimeout = 50;
+// Set on every surface we submit. The encoder copies an input's properties
+// onto the output it makes from it, so this tells us which input an output
+// belongs to even when the encoder reorders frames.
+static const wchar_t *SubmissionProperty = L"VrlinkSubmission";
+// How long ReInit waits for the encoder to give back what it has
+static const amf_int64 DrainTimeout = 1000;
+
+class AllocatorBridge;
+
 class AMFComponentImpl : AMFPropertyStorageImpl {
 	std::shared_ptr<amf::AMFComponent> inner;
 	// FILE* videofile;
 	amf::AMFTrace *trace;
+	amf::AMFContext *context;
+	AMFContextImpl *ourContext;
+	AllocatorBridge *allocator = nullptr;
+
+	// The drain thread pulls finished output from the encoder as soon as it's
+	// there, so QueryOutput only has to look in the queue
+	struct Output {
+		AMF_RESULT result;
+		amf::AMFData *data;
+	};
+	std::mutex outputLock;
+	std::condition_variable outputReady;
+	std::condition_variable inputReady;
+	std::deque<Output> outputs;
+	// Frames we've submitted and haven't seen output for yet, so the drain
+	// thread knows when to ask
+	uint64_t inFlight = 0;
+	// The surfaces the encoder has, in submit order. Their output tells the
+	// driver they're free, see outputDone.
+	struct Submission {
+		uint64_t id;
+		AMFSurfaceImpl *surface;
+	};
+	std::deque<Submission> submitted;
+	uint64_t submissions = 0;
+	bool untaggedOutput = false;
+	bool draining = false;
+	HANDLE drainThread = nullptr;
+	// How long QueryOutput waits, as the driver set it on the encoder
+	amf_int64 queryTimeout = 0;
+	// Interned, set once the driver has set it
+	const wchar_t *queryTimeoutName = nullptr;
+
+	static DWORD WINAPI drainMain(LPVOID arg);
+	void startDrain();
+	// Stops the thread but leaves the queues alone. Returns whether it was
+	// running
+	bool pauseDrain();
+	void stopDrain();
+	// Takes output until the encoder says EOF after a Drain. Only while the
+	// drain thread isn't running.
+	void collectDrained();
+	// Puts the drain thread's timeout back on the encoder after a usage
+	// change reset it
+	void restoreQueryTimeout();
+	// Tells the driver the surface the output was made from is free. Not
+	// with outputLock held, the driver might call us back.
+	void outputDone(amf::AMFData *data);
+	// Same for every surface still in the encoder, after EOF, a Flush or
+	// Terminate
+	void allOutputsDone();
+	void releaseSubmitted(AMFSurfaceImpl *surface);
 	
 public:
-	AMFComponentImpl(std::shared_ptr<amf::AMFComponent> inner, amf::AMFTrace *trace) : inner(inner), AMFPropertyStorageImpl(inner), trace(trace) {
+	AMFComponentImpl(std::shared_ptr<amf::AMFComponent> inner, amf::AMFTrace *trace, AMFContextImpl *ourContext, std::vector<PolicyRule> policy) : inner(inner), AMFPropertyStorageImpl(inner), trace(trace), context(ourContext->inner.get()), ourContext(ourContext) {
+		cacheProperties = true;
+		this->policy = std::move(policy);
 		// char filename[256];
 		// int fd;
 		// for(uint32_t i = 0; i < 16; i++) {
@@ -622,6 +847,9 @@ public:
 
 	AMF_DECLARE_IID(0x8b51e5e4, 0x455d, 0x4034, 0xa7, 0x46, 0xde, 0x1b, 0xed, 0xc3, 0xc4, 0x6)
 
+	// AMFPropertyStorage
+	MSABI virtual AMF_RESULT SetProperty(const char16_t* name, amf::AMFVariantStruct value);
+
 	// AMFPropertyEx
 	MSABI virtual amf_size GetPropertiesInfoCount() const;
 	MSABI virtual AMF_RESULT GetPropertyInfo(amf_size index, const amf::AMFPropertyInfo** ppInfo) const;
@@ -713,10 +941,185 @@ public:
 	MSABI virtual void RemoveObserver(amf::AMFBufferObserver* pObserver);
 };
 
+// Keeps the memory of the wrappers we hand out every frame around, so
+// after the first few frames nothing is allocated.
+template<typename T>
+class WrapperPool {
+	static inline std::mutex lock;
+	static inline std::vector<void*> free;
+
+public:
+	static void recycle(AMFInterfaceImpl *obj) {
+		T *wrapper = (T*)obj;
+		wrapper->~T();
+
+		std::unique_lock guard(lock);
+		free.push_back(wrapper);
+	}
+
+	template<typename... Args>
+	static T *make(Args&&... args) {
+		ZoneScoped;
+		void *mem = nullptr;
+		{
+			std::unique_lock guard(lock);
+			if(!free.empty()) {
+				mem = free.back();
+				free.pop_back();
+			}
+		}
+		if(mem == nullptr) mem = ::operator new(sizeof(T));
+
+		T *wrapper = new(mem) T(std::forward<Args>(args)...);
+		((AMFInterfaceImpl*)wrapper)->recycle = recycle;
+		return wrapper;
+	}
+};
+
+// A shared_ptr that doesn't own anything, so there's no control block to
+// allocate. The wrapper's own count keeps the host object alive.
+template<typename T>
+static std::shared_ptr<T> unowned(T *ptr) {
+	return std::shared_ptr<T>(std::shared_ptr<T>(), ptr);
+}
+
+// Set on every thread that has come through one of our entry points. Those
+// are the threads wine knows about, anything else is the host AMF runtime's
+// own and mustn't call into Windows code.
+static thread_local bool wineThread = false;
+
+// The driver's allocator. We only ever have pointers the driver gave us, so
+// all that matters is that the vtable lines up.
+class WinDataAllocatorCB : AMFInterfaceImpl {
+public:
+	MSABI virtual AMF_RESULT AllocBuffer(amf::AMF_MEMORY_TYPE type, amf_size size, amf::AMFBuffer** ppBuffer) = 0;
+	MSABI virtual AMF_RESULT AllocSurface(amf::AMF_MEMORY_TYPE type, amf::AMF_SURFACE_FORMAT format, amf_int32 width, amf_int32 height, amf_int32 hPitch, amf_int32 vPitch, amf::AMFSurface** ppSurface) = 0;
+};
+
+// Handed to the host encoder in place of the driver's allocator. Host
+// buffers are made on top of the memory of the driver's buffers, so the
+// bitstream ends up where the driver wants it without a copy.
+class AllocatorBridge : public amf::AMFDataAllocatorCB, public amf::AMFBufferObserver {
+	std::atomic<amf_long> refs = 1;
+	WinDataAllocatorCB *callback;
+	amf::AMFContext *context;
+
+	// The driver's buffer under each host buffer we made
+	std::mutex buffersLock;
+	std::vector<std::pair<amf::AMFBuffer*, AMFBufferImpl*>> buffers;
+	// Host buffers that went away on a host thread
+	std::vector<AMFBufferImpl*> released;
+
+	AMF_RESULT allocHost(amf::AMF_MEMORY_TYPE type, amf_size size, amf::AMFBuffer** ppBuffer) {
+		return context->AllocBuffer(type, size, ppBuffer);
+	}
+public:
+	AllocatorBridge(WinDataAllocatorCB *callback, amf::AMFContext *context) : callback(callback), context(context) {
+		((AMFInterfaceImpl*)callback)->Acquire();
+	};
+	~AllocatorBridge() {
+		if(!wineThread) {
+			WINE_ERR("Allocator released on a host thread, leaking the driver's allocator\n");
+			return;
+		}
+		collect();
+		((AMFInterfaceImpl*)callback)->Release();
+	};
+
+	// Gives the driver back the buffers the host let go of while we couldn't
+	void collect() {
+		assert(wineThread);
+		std::unique_lock lock(buffersLock);
+		for(AMFBufferImpl *theirs : released) {
+			((AMFInterfaceImpl*)theirs)->Release();
+		}
+		released.clear();
+	}
+
+	amf_long AMF_STD_CALL Acquire() override {
+		return ++refs;
+	}
+	amf_long AMF_STD_CALL Release() override {
+		amf_long ret = --refs;
+		if(ret == 0) delete this;
+		return ret;
+	}
+	AMF_RESULT AMF_STD_CALL QueryInterface(const amf::AMFGuid& interfaceID, void** ppInterface) override {
+		if(interfaceID == amf::AMFDataAllocatorCB::IID() || interfaceID == amf::AMFInterface::IID()) {
+			Acquire();
+			*ppInterface = (amf::AMFDataAllocatorCB*)this;
+			return AMF_RESULT::AMF_OK;
+		}
+		return AMF_RESULT::AMF_NO_INTERFACE;
+	}
+
+	AMF_RESULT AMF_STD_CALL AllocBuffer(amf::AMF_MEMORY_TYPE type, amf_size size, amf::AMFBuffer** ppBuffer) override {
+		ZoneScoped;
+		// The driver only has host memory for us, and can only be called
+		// from a wine thread
+		if(type != amf::AMF_MEMORY_HOST || !wineThread) return allocHost(type, size, ppBuffer);
+		collect();
+
+		AMFBufferImpl *theirs = nullptr;
+		AMF_RESULT ret = callback->AllocBuffer(type, size, (amf::AMFBuffer**)&theirs);
+		if(ret != AMF_RESULT::AMF_OK || theirs == nullptr) {
+			WINE_TRACE("Driver couldn't allocate %lu bytes (%d), using a host buffer\n", size, ret);
+			return allocHost(type, size, ppBuffer);
+		}
+
+		void *mem = theirs->GetNative();
+		amf_size theirSize = theirs->GetSize();
+		if(mem == nullptr || theirSize < size) {
+			WINE_ERR("Driver gave us a buffer of %lu bytes, wanted %lu\n", theirSize, size);
+			((AMFInterfaceImpl*)theirs)->Release();
+			return allocHost(type, size, ppBuffer);
+		}
+
+		ret = context->CreateBufferFromHostNative(mem, theirSize, ppBuffer, this);
+		if(ret != AMF_RESULT::AMF_OK) {
+			((AMFInterfaceImpl*)theirs)->Release();
+			return ret;
+		}
+
+		std::unique_lock lock(buffersLock);
+		buffers.push_back({*ppBuffer, theirs});
+		return ret;
+	}
+	AMF_RESULT AMF_STD_CALL AllocSurface(amf::AMF_MEMORY_TYPE type, amf::AMF_SURFACE_FORMAT format, amf_int32 width, amf_int32 height, amf_int32 hPitch, amf_int32 vPitch, amf::AMFSurface** ppSurface) override {
+		// Encoders only ever want buffers
+		return context->AllocSurface(type, format, width, height, ppSurface);
+	}
+
+	void AMF_STD_CALL OnBufferDataRelease(amf::AMFBuffer* pBuffer) override {
+		AMFBufferImpl *theirs = nullptr;
+		{
+			std::unique_lock lock(buffersLock);
+			for(auto it = buffers.begin(); it != buffers.end(); it++) {
+				if(it->first != pBuffer) continue;
+				theirs = it->second;
+				buffers.erase(it);
+				break;
+			}
+			if(theirs == nullptr) return;
+
+			if(!wineThread) {
+				released.push_back(theirs);
+				return;
+			}
+		}
+		((AMFInterfaceImpl*)theirs)->Release();
+	}
+};
+
 MSABI amf_long AMFInterfaceImpl::Acquire() {
 	WINE_TRACE("()\n");
 
-	auto ret = inner->Acquire();
+	amf_long ret;
+	if(recycle != nullptr) {
+		ret = ++refs;
+	} else {
+		ret = inner->Acquire();
+	}
 
 	WINE_TRACE("=> %ld\n", ret);
 	return ret;
@@ -724,7 +1127,19 @@ MSABI amf_long AMFInterfaceImpl::Acquire() {
 MSABI amf_long AMFInterfaceImpl::Release() {
 	WINE_TRACE("()\n");
 
-	auto ret = inner->Release();
+	amf_long ret;
+	if(recycle != nullptr) {
+		ret = --refs;
+		if(ret == 0) {
+			// Letting go of a host surface can recycle its wrapper, so we're
+			// done with this first
+			amf::AMFInterface *host = inner.get();
+			recycle(this);
+			host->Release();
+		}
+	} else {
+		ret = inner->Release();
+	}
 
 	WINE_TRACE("=> %ld\n", ret);
 	return ret;
@@ -741,7 +1156,7 @@ MSABI AMF_RESULT AMFInterfaceImpl::QueryInterface(const amf::AMFGuid& interfaceI
 	if(interfaceID == amf::AMFBuffer::IID()) {
 		WINE_TRACE("Retuning wrapped buffer\n");
 		AMF_RESULT ret = inner->QueryInterface(interfaceID, ppInterface);
-		if(*ppInterface != nullptr) *ppInterface = new AMFBufferImpl(std::shared_ptr<amf::AMFBuffer>((amf::AMFBuffer*)*ppInterface));
+		if(*ppInterface != nullptr) *ppInterface = WrapperPool<AMFBufferImpl>::make(unowned((amf::AMFBuffer*)*ppInterface));
 
 		return ret;
 	}
@@ -750,41 +1165,193 @@ MSABI AMF_RESULT AMFInterfaceImpl::QueryInterface(const amf::AMFGuid& interfaceI
 	return AMF_RESULT::AMF_FAIL;
 }
 
+// How much of the value there is to compare, 0 for the types we don't cache
+static size_t cachedVariantSize(const amf::AMFVariantStruct &value) {
+	switch(value.type) {
+		case amf::AMF_VARIANT_BOOL: return sizeof(value.boolValue);
+		case amf::AMF_VARIANT_INT64: return sizeof(value.int64Value);
+		case amf::AMF_VARIANT_DOUBLE: return sizeof(value.doubleValue);
+		case amf::AMF_VARIANT_RECT: return sizeof(value.rectValue);
+		case amf::AMF_VARIANT_SIZE: return sizeof(value.sizeValue);
+		case amf::AMF_VARIANT_POINT: return sizeof(value.pointValue);
+		case amf::AMF_VARIANT_RATE: return sizeof(value.rateValue);
+		case amf::AMF_VARIANT_RATIO: return sizeof(value.ratioValue);
+		case amf::AMF_VARIANT_COLOR: return sizeof(value.colorValue);
+		case amf::AMF_VARIANT_FLOAT: return sizeof(value.floatValue);
+		case amf::AMF_VARIANT_FLOAT_SIZE: return sizeof(value.floatSize);
+		case amf::AMF_VARIANT_FLOAT_POINT2D: return sizeof(value.floatPoint2D);
+		case amf::AMF_VARIANT_FLOAT_POINT3D: return sizeof(value.floatPoint3D);
+		case amf::AMF_VARIANT_FLOAT_VECTOR4D: return sizeof(value.floatVector4D);
+		default: return 0;
+	}
+}
+
+static bool policyNumber(const amf::AMFVariantStruct &value, double *out) {
+	switch(value.type) {
+		case amf::AMF_VARIANT_INT64: *out = (double)value.int64Value; return true;
+		case amf::AMF_VARIANT_DOUBLE: *out = value.doubleValue; return true;
+		case amf::AMF_VARIANT_FLOAT: *out = value.floatValue; return true;
+		default: return false;
+	}
+}
+
+// Returns true if the rule changed the value
+static bool applyPolicy(const PolicyRule &rule, amf::AMFVariantStruct *value) {
+	if(rule.op == PolicyRule::Force) {
+		size_t size = cachedVariantSize(rule.value);
+		if(value->type == rule.value.type && memcmp(&value->int64Value, &rule.value.int64Value, size) == 0) return false;
+		*value = rule.value;
+		return true;
+	}
+
+	double ours, theirs;
+	if(!policyNumber(rule.value, &ours) || !policyNumber(*value, &theirs)) {
+		WINE_WARN("Policy can't clamp %ls of type %d\n", rule.name, value->type);
+		return false;
+	}
+	if(rule.op == PolicyRule::AtMost ? theirs <= ours : theirs >= ours) return false;
+
+	// Keep the type the driver used
+	if(value->type == amf::AMF_VARIANT_INT64) value->int64Value = (amf_int64)ours;
+	else if(value->type == amf::AMF_VARIANT_FLOAT) value->floatValue = (amf_float)ours;
+	else value->doubleValue = ours;
+	return true;
+}
+
+// Setting the usage resets everything else to the usage's defaults
+static bool isUsageProperty(const wchar_t *name) {
+	return wcscmp(name, L"Usage") == 0 || wcscmp(name, L"HevcUsage") == 0 || wcscmp(name, L"Av1Usage") == 0;
+}
+
+// The encoders all have their own name for it
+static const wchar_t *queryTimeoutNames[] = {
+	L"QueryTimeout",
+	L"HevcQueryTimeout",
+	L"Av1QueryTimeout",
+};
+
+// The component keeps these to itself, see AMFComponentImpl::SetProperty
+static bool isQueryTimeoutProperty(const wchar_t *name) {
+	for(const wchar_t *timeoutName : queryTimeoutNames) {
+		if(wcscmp(name, timeoutName) == 0) return true;
+	}
+	return false;
+}
+
 MSABI AMF_RESULT AMFPropertyStorageImpl::SetProperty(const char16_t* name, amf::AMFVariantStruct value) {
 	ZoneScoped;
-	char32_t *linuxName = winWStrToLinux(name);
-	WINE_TRACE("(%ls, %d)\n", (wchar_t*)linuxName, value.type);
+	const wchar_t *linuxName = internWinWStr(name);
+	WINE_TRACE("(%ls, %d)\n", linuxName, value.type);
+
+	for(const PolicyRule &rule : policy) {
+		if(rule.name != linuxName) continue;
+		if(applyPolicy(rule, &value)) WINE_WARN("Policy overrode %ls set by the driver\n", linuxName);
+	}
+
+	size_t size = cacheProperties ? cachedVariantSize(value) : 0;
+	if(size != 0) {
+		std::unique_lock lock(propertiesLock);
+		auto it = properties.find(linuxName);
+		// The driver sets the same rate control over and over, and the
+		// encoder might reconfigure itself for every one of them
+		if(it != properties.end() && it->second.type == value.type && memcmp(&it->second.int64Value, &value.int64Value, size) == 0) {
+			WINE_TRACE("=> %d (unchanged)\n", AMF_RESULT::AMF_OK);
+			return AMF_RESULT::AMF_OK;
+		}
+	}
+
+	AMF_RESULT ret = inner->SetProperty(linuxName, value);
+
+	if(ret == AMF_RESULT::AMF_OK && isUsageProperty(linuxName)) {
+		// Nothing we remember is true anymore, and the forced values have to
+		// go in again
+		clearProperties();
+		for(const PolicyRule &rule : policy) {
+			if(rule.op != PolicyRule::Force || rule.name == linuxName || isQueryTimeoutProperty(rule.name)) continue;
+			inner->SetProperty(rule.name, rule.value);
+		}
+	}
+
+	if(cacheProperties) {
+		std::unique_lock lock(propertiesLock);
+		if(size != 0 && ret == AMF_RESULT::AMF_OK) {
+			properties[linuxName] = value;
+		} else {
+			properties.erase(linuxName);
+		}
+	}
 
-	AMF_RESULT ret = inner->SetProperty((wchar_t*)linuxName, value);
-	/* free(linuxName); */
-	
 	WINE_TRACE("=> %d\n", ret);
 	return ret;
 }
 MSABI AMF_RESULT AMFPropertyStorageImpl::GetProperty(const char16_t* name, amf::AMFVariantStruct* pValue) const {
 	ZoneScoped;
-	char32_t *linuxName = winWStrToLinux(name);
-	WINE_TRACE("(%ls %p)\n", (wchar_t*)linuxName, pValue);
+	const wchar_t *linuxName = internWinWStr(name);
+	WINE_TRACE("(%ls %p)\n", linuxName, pValue);
+
+	if(cacheProperties) {
+		std::unique_lock lock(propertiesLock);
+		auto it = properties.find(linuxName);
+		if(it != properties.end()) {
+			*pValue = it->second;
+			WINE_TRACE("=> %d (cached)\n", AMF_RESULT::AMF_OK);
+			return AMF_RESULT::AMF_OK;
+		}
+	}
 
-	AMF_RESULT ret = inner->GetProperty((wchar_t*)linuxName, pValue);
+	AMF_RESULT ret = inner->GetProperty(linuxName, pValue);
 	WINE_TRACE("Value type is %d \n", pValue->type);
 
-	/* free(linuxName); */
 	WINE_TRACE("=> %d\n", ret);
 	return ret;
 }
 
 MSABI amf_bool AMFPropertyStorageImpl::HasProperty(const char16_t* name) const {
-	STUB();
-	return false;
+	ZoneScoped;
+	const wchar_t *linuxName = internWinWStr(name);
+	WINE_TRACE("(%ls)\n", linuxName);
+
+	if(cacheProperties) {
+		std::unique_lock lock(propertiesLock);
+		if(properties.find(linuxName) != properties.end()) return true;
+	}
+
+	amf_bool ret = inner->HasProperty(linuxName);
+
+	WINE_TRACE("=> %d\n", ret);
+	return ret;
 }
+// The cache only knows what we set, so listing them is up to the host
 MSABI amf_size AMFPropertyStorageImpl::GetPropertyCount() const {
-	STUB();
-	return 0;
+	WINE_TRACE("()\n");
+
+	amf_size ret = inner->GetPropertyCount();
+
+	WINE_TRACE("=> %lu\n", ret);
+	return ret;
 }
 MSABI AMF_RESULT AMFPropertyStorageImpl::GetPropertyAt(amf_size index, char16_t* name, amf_size nameSize, amf::AMFVariantStruct* pValue) const {
-	STUB();
-	return AMF_RESULT::AMF_FAIL;
+	ZoneScoped;
+	WINE_TRACE("(%lu %p %lu %p)\n", index, name, nameSize, pValue);
+
+	wchar_t linuxName[256];
+	AMF_RESULT ret = inner->GetPropertyAt(index, linuxName, sizeof(linuxName) / sizeof(*linuxName), pValue);
+	if(ret != AMF_RESULT::AMF_OK) goto done;
+
+	for(amf_size i = 0; ; i++) {
+		if(i >= nameSize) {
+			ret = AMF_RESULT::AMF_BUFFER_TOO_SMALL;
+			break;
+		}
+		// Property names are all ASCII
+		assert((linuxName[i] & 0xFFFFFF80) == 0);
+		name[i] = (char16_t)linuxName[i];
+		if(linuxName[i] == 0) break;
+	}
+
+done:
+	WINE_TRACE("=> %d\n", ret);
+	return ret;
 }
 
 MSABI AMF_RESULT AMFPropertyStorageImpl::Clear() {
@@ -878,10 +1445,51 @@ MSABI AMF_RESULT AMFSurfaceImpl::CopySurfaceRegion(amf::AMFSurface* pDest, amf_i
 	return AMF_RESULT::AMF_FAIL;
 }
 MSABI void AMFSurfaceImpl::AddObserver(amf::AMFSurfaceObserver* pObserver) {
-	STUB();
+	WINE_TRACE("(%p)\n", pObserver);
+
+	std::unique_lock lock(observersLock);
+	// The driver might add the same one twice
+	for(size_t i = 0; i < observerCount; i++) {
+		if(observers[i] == pObserver) return;
+	}
+	if(observerCount >= MaxSurfaceObservers) {
+		WINE_ERR("Too many observers on surface %p, dropping %p\n", this, pObserver);
+		return;
+	}
+	observers[observerCount++] = pObserver;
 }
 MSABI void AMFSurfaceImpl::RemoveObserver(amf::AMFSurfaceObserver* pObserver) {
-	STUB();
+	WINE_TRACE("(%p)\n", pObserver);
+
+	std::unique_lock lock(observersLock);
+	for(size_t i = 0; i < observerCount; i++) {
+		if(observers[i] != pObserver) continue;
+		observers[i] = observers[--observerCount];
+		return;
+	}
+}
+
+// The driver's surface observer, same deal as WinDataAllocatorCB
+class WinSurfaceObserver {
+public:
+	MSABI virtual void OnSurfaceDataRelease(amf::AMFSurface* pSurface) = 0;
+};
+
+void AMFSurfaceImpl::notifyReleased() {
+	ZoneScoped;
+	assert(wineThread);
+
+	// The driver is free to remove itself from in there
+	amf::AMFSurfaceObserver *current[MaxSurfaceObservers];
+	size_t count;
+	{
+		std::unique_lock lock(observersLock);
+		count = observerCount;
+		for(size_t i = 0; i < count; i++) current[i] = observers[i];
+	}
+	for(size_t i = 0; i < count; i++) {
+		((WinSurfaceObserver*)current[i])->OnSurfaceDataRelease((amf::AMFSurface*)this);
+	}
 }
 
 MSABI AMF_RESULT AMFBufferImpl::SetSize(amf_size newSize) {
@@ -910,8 +1518,25 @@ MSABI void AMFBufferImpl::RemoveObserver(amf::AMFBufferObserver* pObserver) {
 }
 
 MSABI AMF_RESULT AMFContextImpl::Terminate() {
-	STUB();
-	return AMF_RESULT::AMF_FAIL;
+	ZoneScoped;
+	WINE_TRACE("()\n");
+	wineThread = true;
+	collectReleased();
+
+	// Surfaces the encoder or the driver still hold keep their texture until
+	// they're gone
+	std::vector<SharedTexture*> cached;
+	{
+		std::unique_lock lock(surfacesLock);
+		for(auto &entry : surfaces) cached.push_back(entry.second);
+		surfaces.clear();
+	}
+	for(SharedTexture *shared : cached) evictTexture(shared);
+
+	AMF_RESULT ret = inner->Terminate();
+
+	WINE_TRACE("=> %d\n", ret);
+	return ret;
 }
 
 // DX9
@@ -958,6 +1583,16 @@ MSABI AMF_RESULT AMFContextImpl::InitDX11(void* pDX11Device, amf::AMF_DX_VERSION
 
 	WINE_TRACE("Vulkan handles after unwrap %p %p %p\n", vkInstance, vkPhysDevice, vkDevice);
 
+	uint32_t queueFamily;
+	dxvkDevice->GetSubmissionQueue(&dxvkQueue, &queueFamily);
+	dxvkQueue = (VkQueue)wine_unwrap_queue(dxvkQueue);
+	this->dxvkDevice = dxvkDevice;
+
+	PFN_vkGetDeviceProcAddr p_vkGetDeviceProcAddr = (PFN_vkGetDeviceProcAddr)p_vkGetInstanceProcAddr(vkInstance, "vkGetDeviceProcAddr");
+	p_vkCreateSemaphore = (PFN_vkCreateSemaphore)p_vkGetDeviceProcAddr(vkDevice, "vkCreateSemaphore");
+	p_vkDestroySemaphore = (PFN_vkDestroySemaphore)p_vkGetDeviceProcAddr(vkDevice, "vkDestroySemaphore");
+	p_vkQueueSubmit = (PFN_vkQueueSubmit)p_vkGetDeviceProcAddr(vkDevice, "vkQueueSubmit");
+
 	assert(device == nullptr);
 	device = std::make_unique<amf::AMFVulkanDevice>(amf::AMFVulkanDevice{
 		.cbSizeof = sizeof(amf::AMFVulkanDevice),
@@ -1108,15 +1743,76 @@ MSABI AMF_RESULT AMFContextImpl::CreateSurfaceFromDX9Native(void* pDX9Surface, a
 MSABI AMF_RESULT AMFContextImpl::CreateSurfaceFromDX11Native(void* pDX11Surface, amf::AMFSurface** ppSurface, amf::AMFSurfaceObserver* pObserver) {
 	ZoneScoped;
 	WINE_TRACE("(%p %p %p)\n", pDX11Surface, ppSurface, pObserver);
+	wineThread = true;
+	collectReleased();
 
 	if(pDX11Surface == nullptr) {
 		WINE_ERR("DX11 Surface cannot be NULL\n");
 		return AMF_RESULT::AMF_INVALID_ARG;
 	}
 
+	ID3D11Texture2D *dx11Texture = (ID3D11Texture2D*)pDX11Surface;
+	SharedTexture *shared;
+	SharedTexture *evicted = nullptr;
+	{
+		std::unique_lock lock(surfacesLock);
+		auto it = surfaces.find(dx11Texture);
+		if(it != surfaces.end()) {
+			shared = it->second;
+			WINE_TRACE("Texture %p already wrapped\n", dx11Texture);
+		} else {
+			AMF_RESULT ret = importDX11Texture(dx11Texture, &shared);
+			if(ret != AMF_RESULT::AMF_OK) return ret;
+			ret = wrapTexture(shared);
+			if(ret != AMF_RESULT::AMF_OK) {
+				lock.unlock();
+				unrefTexture(shared);
+				return ret;
+			}
+
+			if(surfaces.size() >= SurfaceCacheSize) {
+				auto oldest = surfaces.begin();
+				for(auto entry = surfaces.begin(); entry != surfaces.end(); entry++) {
+					if(entry->second->lastUse < oldest->second->lastUse) oldest = entry;
+				}
+				WINE_TRACE("Evicting texture %p\n", oldest->first);
+				evicted = oldest->second;
+				surfaces.erase(oldest);
+			}
+			surfaces[dx11Texture] = shared;
+		}
+		shared->lastUse = surfaceUses++;
+		// The caller's, they release it when they're done
+		((AMFInterfaceImpl*)shared->surface)->refs++;
+	}
+	if(evicted != nullptr) evictTexture(evicted);
+
+	AMFSurfaceImpl *surface = shared->surface;
+	// Whatever the driver set for the last frame doesn't carry over, unless
+	// the encoder still has that frame
+	if(!surface->inEncoder) {
+		shared->host->Clear();
+		shared->host->SetPts(0);
+		shared->host->SetDuration(0);
+		// dxvk has had the image since the encoder last left a layout in the
+		// import
+		shared->vulkan.eCurrentLayout = VK_IMAGE_LAYOUT_GENERAL;
+	}
+	if(pObserver != nullptr) surface->AddObserver(pObserver);
+
+	*ppSurface = (amf::AMFSurface*)surface;
+	WINE_TRACE("=> %d %p\n", AMF_RESULT::AMF_OK, *ppSurface);
+	return AMF_RESULT::AMF_OK;
+}
+
+AMF_RESULT AMFContextImpl::importDX11Texture(ID3D11Texture2D *dx11Texture, SharedTexture **ppShared) {
 	amf::AMFVulkanDevice *vulkanDevice = (amf::AMFVulkanDevice*)inner->GetVulkanDevice();
 
-	ID3D11Texture2D *dx11Texture = (ID3D11Texture2D*)pDX11Surface;
+	if(dxvkDevice == nullptr) {
+		WINE_ERR("DX11 surfaces need the context to be initialized with InitDX11\n");
+		return AMF_RESULT::AMF_NOT_INITIALIZED;
+	}
+
 	IDXGIVkInteropSurface *dxvkSurface;
 	if(dx11Texture->QueryInterface(__uuidof(IDXGIVkInteropSurface), (void**)&dxvkSurface) != 0) {
 		WINE_ERR("Given ID3DTexture2D doesn't support IDXVkInteropSurface. Only DXVK is supported.\n");
@@ -1133,6 +1829,7 @@ MSABI AMF_RESULT AMFContextImpl::CreateSurfaceFromDX11Native(void* pDX11Surface,
 	VkImage image;
 	if(dxvkSurface->GetVulkanImageInfo(&image, &layout, &createInfo) != 0) {
 		WINE_TRACE("Couldn't get the vulkan data from the texture %p\n", dxvkSurface);
+		dxvkSurface->Release();
 		return AMF_RESULT::AMF_FAIL;
 	}
 	WINE_TRACE("Vulkan texture %dx%d on device %p\n", createInfo.extent.width, createInfo.extent.height, vulkanDevice->hDevice);
@@ -1141,38 +1838,163 @@ MSABI AMF_RESULT AMFContextImpl::CreateSurfaceFromDX11Native(void* pDX11Surface,
 	VkDeviceSize memSize;
 	if(dxvkSurface->GetVulkanDeviceMemory(&memory, &memSize) != 0) {
 		WINE_TRACE("Couldn't get the vulkan device memory from the texture %p\n", dxvkSurface);
+		dxvkSurface->Release();
 		return AMF_RESULT::AMF_FAIL;
 	}
+	dxvkSurface->Release();
 	memory = (VkDeviceMemory)wine_unwrap_dev_mem(memory);
 	WINE_TRACE("Texture storage %p size %ld format %d\n", memory, memSize, createInfo.format);
 
-	auto amfSurface = std::make_unique<amf::AMFVulkanSurface>(amf::AMFVulkanSurface {
-		.cbSizeof = sizeof(amf::AMFVulkanSurface),
-		.hImage = image,
-		.hMemory = memory,
-		.iSize = (int32_t)memSize,
-		.eFormat = createInfo.format,
-		.iWidth = (int32_t)createInfo.extent.width,
-		.iHeight = (int32_t)createInfo.extent.height,
-		.eCurrentLayout = VK_IMAGE_LAYOUT_GENERAL,
-		.eUsage = createInfo.usage,
-		.eAccess = amf::AMF_MEMORY_CPU_ACCESS_BITS::AMF_MEMORY_CPU_DEFAULT,
-		.Sync = {
-			.cbSizeof = sizeof(amf::AMFVulkanSync),
-			.hSemaphore = nullptr,
-			.bSubmitted = false,
-			.hFence = nullptr,
+	// Each texture gets its own semaphore so the encoder only waits for the
+	// work that came before this texture was submitted
+	VkSemaphore semaphore;
+	VkSemaphoreCreateInfo semaphoreInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+	};
+	VK_CHECK_RESULT(p_vkCreateSemaphore(vulkanDevice->hDevice, &semaphoreInfo, nullptr, &semaphore));
+
+	dx11Texture->AddRef();
+	*ppShared = new SharedTexture{
+		.texture = dx11Texture,
+		.vulkan = {
+			.cbSizeof = sizeof(amf::AMFVulkanSurface),
+			.hImage = image,
+			.hMemory = memory,
+			.iSize = (int32_t)memSize,
+			.eFormat = createInfo.format,
+			.iWidth = (int32_t)createInfo.extent.width,
+			.iHeight = (int32_t)createInfo.extent.height,
+			.eCurrentLayout = VK_IMAGE_LAYOUT_GENERAL,
+			.eUsage = createInfo.usage,
+			.eAccess = amf::AMF_MEMORY_CPU_ACCESS_BITS::AMF_MEMORY_CPU_DEFAULT,
+			.Sync = {
+				.cbSizeof = sizeof(amf::AMFVulkanSync),
+				.hSemaphore = semaphore,
+				.bSubmitted = false,
+				.hFence = nullptr,
+			}
+		},
+		.host = nullptr,
+		.surface = nullptr,
+		.lastUse = 0,
+		// The cache's
+		.refs = 1,
+	};
+	return AMF_RESULT::AMF_OK;
+}
+
+AMF_RESULT AMFContextImpl::wrapTexture(SharedTexture *shared) {
+	amf::AMFSurface *host = nullptr;
+	AMF_RESULT ret = inner->CreateSurfaceFromVulkanNative(&shared->vulkan, &host, &surfaceBridge);
+	if(ret != AMF_RESULT::AMF_OK || host == nullptr) {
+		WINE_ERR("The host couldn't make a surface from texture %p: %d\n", shared->texture, ret);
+		return ret == AMF_RESULT::AMF_OK ? AMF_RESULT::AMF_FAIL : ret;
+	}
+
+	WINE_TRACE("Wrap surface %p\n", host);
+	// Starts out with the cache's reference. Once that and everyone else's
+	// are gone it goes back to the pool and lets go of the host surface.
+	AMFSurfaceImpl *surface = WrapperPool<AMFSurfaceImpl>::make(unowned(host));
+	surface->shared = shared;
+	surface->context = this;
+	shared->host = host;
+	shared->surface = surface;
+	// Until the host tells us it's gone
+	shared->refs++;
+	{
+		std::unique_lock lock(liveLock);
+		liveSurfaces.emplace_back(host, shared);
+	}
+	return AMF_RESULT::AMF_OK;
+}
+
+void AMFContextImpl::evictTexture(SharedTexture *shared) {
+	((AMFInterfaceImpl*)shared->surface)->Release();
+	unrefTexture(shared);
+}
+
+void AMFContextImpl::unrefTexture(SharedTexture *shared) {
+	assert(wineThread);
+	{
+		std::unique_lock lock(surfacesLock);
+		if(--shared->refs != 0) return;
+	}
+
+	// The host surface is gone, so nothing can be waiting on the semaphore
+	WINE_TRACE("Done with texture %p\n", shared->texture);
+	p_vkDestroySemaphore(device->hDevice, shared->vulkan.Sync.hSemaphore, nullptr);
+	shared->texture->Release();
+	delete shared;
+}
+
+void AMFContextImpl::SurfaceBridge::OnSurfaceDataRelease(amf::AMFSurface* pSurface) {
+	ZoneScoped;
+	SharedTexture *shared = nullptr;
+	{
+		std::unique_lock lock(context->liveLock);
+		auto &live = context->liveSurfaces;
+		for(auto it = live.begin(); it != live.end(); it++) {
+			if(it->first != pSurface) continue;
+			shared = it->second;
+			*it = live.back();
+			live.pop_back();
+			break;
 		}
-	});
+		if(shared == nullptr) {
+			WINE_ERR("Host released surface %p we don't know about\n", pSurface);
+			return;
+		}
+		// The texture is dxvk's, that's only for wine threads
+		if(!wineThread) {
+			context->releasedTextures.push_back(shared);
+			return;
+		}
+	}
+	context->unrefTexture(shared);
+}
 
-	AMF_RESULT ret = inner->CreateSurfaceFromVulkanNative(amfSurface.get(), ppSurface, pObserver);
-	if(*ppSurface != nullptr) {
-		WINE_TRACE("Wrap surface %p\n", *ppSurface);
-		*ppSurface = (amf::AMFSurface*)new AMFSurfaceImpl(std::shared_ptr<amf::AMFSurface>(*ppSurface), std::move(amfSurface), std::unique_ptr<ID3D11Texture2D>(dx11Texture));
+void AMFContextImpl::collectReleased() {
+	assert(wineThread);
+	std::vector<SharedTexture*> released;
+	{
+		std::unique_lock lock(liveLock);
+		if(releasedTextures.empty()) return;
+		released.swap(releasedTextures);
+	}
+	for(SharedTexture *shared : released) {
+		unrefTexture(shared);
 	}
+}
 
-	WINE_TRACE("=> %d %p\n", ret, *ppSurface);
-	return ret;
+void AMFContextImpl::signalSurface(AMFSurfaceImpl *surface) {
+	ZoneScoped;
+	amf::AMFVulkanSync *sync = &surface->shared->vulkan.Sync;
+
+	// Gets everything dxvk has recorded onto its queue, our signal comes
+	// after it in submission order
+	dxvkDevice->FlushRenderingCommands();
+
+	// If the encoder left the semaphore signalled after the last frame it has
+	// to be waited on before we can signal it again. SubmitInput doesn't let
+	// a surface in twice, so that signal can't belong to a frame the encoder
+	// hasn't started on.
+	VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	VkSubmitInfo submitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.waitSemaphoreCount = sync->bSubmitted ? 1u : 0u,
+		.pWaitSemaphores = &sync->hSemaphore,
+		.pWaitDstStageMask = &waitStage,
+		.commandBufferCount = 0,
+		.signalSemaphoreCount = 1,
+		.pSignalSemaphores = &sync->hSemaphore,
+	};
+	// The queue is only ours for the empty submit
+	dxvkDevice->LockSubmissionQueue();
+	VkResult res = p_vkQueueSubmit(dxvkQueue, 1, &submitInfo, VK_NULL_HANDLE);
+	dxvkDevice->ReleaseSubmissionQueue();
+	VK_CHECK_RESULT(res);
+
+	sync->bSubmitted = true;
 }
 MSABI AMF_RESULT AMFContextImpl::CreateSurfaceFromOpenGLNative(amf::AMF_SURFACE_FORMAT format, amf_handle hGLTextureID, amf::AMFSurface** ppSurface, amf::AMFSurfaceObserver* pObserver) {
 	STUB();
@@ -1314,22 +2136,151 @@ MSABI AMF_RESULT AMFComponentImpl::ValidateProperty(const wchar_t* name, amf::AM
 	return AMF_RESULT::AMF_FAIL;
 }
 
+// Whatever the driver asks for is how long QueryOutput blocks, the encoder
+// itself blocks a little so the drain thread doesn't spin
+MSABI AMF_RESULT AMFComponentImpl::SetProperty(const char16_t* name, amf::AMFVariantStruct value) {
+	const wchar_t *linuxName = internWinWStr(name);
+	if(!isQueryTimeoutProperty(linuxName)) {
+		AMF_RESULT ret = AMFPropertyStorageImpl::SetProperty(name, value);
+		// The new usage came with its own timeout
+		if(ret == AMF_RESULT::AMF_OK && isUsageProperty(linuxName)) restoreQueryTimeout();
+		return ret;
+	}
+	ZoneScoped;
+	WINE_TRACE("(%ls, %d)\n", linuxName, value.type);
+
+	for(const PolicyRule &rule : policy) {
+		if(rule.name != linuxName) continue;
+		if(applyPolicy(rule, &value)) WINE_WARN("Policy overrode %ls set by the driver\n", linuxName);
+	}
+	if(value.type != amf::AMF_VARIANT_INT64) {
+		WINE_ERR("%ls should be an integer, got type %d\n", linuxName, value.type);
+		return AMF_RESULT::AMF_INVALID_ARG;
+	}
+
+	AMF_RESULT ret = inner->SetProperty(linuxName, DrainQueryTimeout);
+	if(ret == AMF_RESULT::AMF_OK) {
+		{
+			std::unique_lock lock(outputLock);
+			queryTimeout = value.int64Value;
+			queryTimeoutName = linuxName;
+		}
+		// Reading it back gives the driver what it set
+		std::unique_lock lock(propertiesLock);
+		properties[linuxName] = value;
+	}
+
+	WINE_TRACE("=> %d\n", ret);
+	return ret;
+}
+
+void AMFComponentImpl::restoreQueryTimeout() {
+	std::unique_lock lock(outputLock);
+	if(queryTimeoutName == nullptr) return;
+	if(inner->SetProperty(queryTimeoutName, DrainQueryTimeout) != AMF_RESULT::AMF_OK) return;
+
+	amf::AMFVariantStruct value;
+	memset(&value, 0, sizeof(value));
+	value.type = amf::AMF_VARIANT_INT64;
+	value.int64Value = queryTimeout;
+	std::unique_lock propertiesGuard(propertiesLock);
+	properties[queryTimeoutName] = value;
+}
+
 MSABI AMF_RESULT AMFComponentImpl::Init(amf::AMF_SURFACE_FORMAT format, amf_int32 width, amf_int32 height) {
 	WINE_TRACE("(%d %d %d)\n", format, width, height);
 
+	// If the driver never set a timeout the encoder's default is what it
+	// gets
+	for(const wchar_t *name : queryTimeoutNames) {
+		amf_int64 timeout;
+		if(inner->GetProperty(name, &timeout) != AMF_RESULT::AMF_OK) continue;
+		std::unique_lock lock(outputLock);
+		if(queryTimeoutName == nullptr) {
+			queryTimeout = timeout;
+			inner->SetProperty(name, DrainQueryTimeout);
+		}
+		break;
+	}
+
 	AMF_RESULT ret = inner->Init(format, width, height);
+	if(ret == AMF_RESULT::AMF_OK) startDrain();
 
 	WINE_TRACE("=> %d\n", ret);
 	return ret;
 }
 MSABI AMF_RESULT AMFComponentImpl::ReInit(amf_int32 width,amf_int32 height) {
-	STUB();
-	return AMF_RESULT::AMF_FAIL;
+	ZoneScoped;
+	WINE_TRACE("(%d %d)\n", width, height);
+	wineThread = true;
+
+	// Nobody can be asking the encoder for output while it's reinitialized.
+	// The properties and the cached surfaces stay as they are.
+	bool running = pauseDrain();
+
+	// The docs don't say what ReInit does with frames that are still in the
+	// encoder, so get them out first. They stay queued for QueryOutput and
+	// their surfaces come back the usual way.
+	if(inner->Drain() == AMF_RESULT::AMF_OK) {
+		collectDrained();
+	} else {
+		WINE_WARN("Couldn't drain the encoder before ReInit\n");
+	}
+
+	AMF_RESULT ret = inner->ReInit(width, height);
+	if(ret == AMF_RESULT::AMF_OK) {
+		std::unique_lock lock(outputLock);
+		inFlight = 0;
+	}
+
+	if(running) startDrain();
+
+	WINE_TRACE("=> %d\n", ret);
+	return ret;
 }
+void AMFComponentImpl::collectDrained() {
+	ZoneScoped;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DrainTimeout);
+	while(true) {
+		amf::AMFData *data = nullptr;
+		AMF_RESULT ret = inner->QueryOutput(&data);
+		ourContext->collectReleased();
+		if(data != nullptr) {
+			outputDone(data);
+			std::unique_lock lock(outputLock);
+			outputs.push_back(Output{
+				.result = ret,
+				.data = data,
+			});
+			continue;
+		}
+		// The driver didn't ask for the EOF, it doesn't get to see it
+		if(ret == AMF_RESULT::AMF_EOF) {
+			allOutputsDone();
+			break;
+		}
+		if(ret != AMF_RESULT::AMF_REPEAT && ret != AMF_RESULT::AMF_OK) {
+			WINE_WARN("Draining the encoder failed with %d\n", ret);
+			break;
+		}
+		if(std::chrono::steady_clock::now() > deadline) {
+			WINE_WARN("The encoder didn't drain in %ldms, reinitializing anyway\n", DrainTimeout);
+			break;
+		}
+		// In case the encoder doesn't do QueryTimeout
+		Sleep(1);
+	}
+}
+
 MSABI AMF_RESULT AMFComponentImpl::Terminate() {
 	WINE_TRACE("()\n");
+	wineThread = true;
 
+	stopDrain();
+	// Whatever the encoder comes back with after this starts out fresh
+	clearProperties();
 	AMF_RESULT ret = inner->Terminate();
+	allOutputsDone();
 
 	WINE_TRACE("=> %d\n", ret);
 	return ret;
@@ -1339,86 +2290,229 @@ MSABI AMF_RESULT AMFComponentImpl::Drain() {
 	return AMF_RESULT::AMF_FAIL;
 }
 MSABI AMF_RESULT AMFComponentImpl::Flush() {
-	return inner->Flush();
+	ZoneScoped;
+	WINE_TRACE("()\n");
+	wineThread = true;
+
+	// Same as ReInit, the drain thread could otherwise queue an output from
+	// before the flush after we've cleared them
+	bool running = pauseDrain();
+
+	AMF_RESULT ret = inner->Flush();
+	allOutputsDone();
+
+	// Whatever was on its way out is gone too
+	{
+		std::unique_lock lock(outputLock);
+		for(Output &output : outputs) {
+			if(output.data != nullptr) output.data->Release();
+		}
+		outputs.clear();
+		inFlight = 0;
+	}
+
+	if(running) startDrain();
+
+	WINE_TRACE("=> %d\n", ret);
+	return ret;
+}
+
+void AMFComponentImpl::outputDone(amf::AMFData *data) {
+	ZoneScoped;
+	AMFSurfaceImpl *surface;
+	{
+		std::unique_lock lock(outputLock);
+		if(submitted.empty()) return;
+
+		auto it = submitted.begin();
+		amf_int64 id;
+		if(data->GetProperty(SubmissionProperty, &id) == AMF_RESULT::AMF_OK) {
+			while(it != submitted.end() && it->id != (uint64_t)id) it++;
+			if(it == submitted.end()) return;
+		} else if(!untaggedOutput) {
+			// Only right if the encoder doesn't reorder, but the driver has
+			// to get its surfaces back somehow
+			WINE_WARN("The encoder doesn't copy input properties to its output, releasing surfaces in submit order\n");
+			untaggedOutput = true;
+		}
+		surface = it->surface;
+		submitted.erase(it);
+	}
+	releaseSubmitted(surface);
+}
+
+void AMFComponentImpl::allOutputsDone() {
+	std::deque<Submission> done;
+	{
+		std::unique_lock lock(outputLock);
+		done.swap(submitted);
+	}
+	for(Submission &submission : done) releaseSubmitted(submission.surface);
+}
+
+void AMFComponentImpl::releaseSubmitted(AMFSurfaceImpl *surface) {
+	surface->inEncoder = false;
+	surface->notifyReleased();
+	((AMFInterfaceImpl*)surface)->Release();
+}
+
+void AMFComponentImpl::startDrain() {
+	std::unique_lock lock(outputLock);
+	if(drainThread != nullptr) return;
+
+	draining = true;
+	drainThread = CreateThread(nullptr, 0, drainMain, this, 0, nullptr);
+	if(drainThread == nullptr) {
+		WINE_ERR("Could not start the drain thread, QueryOutput will poll the encoder\n");
+		draining = false;
+	}
+}
+
+bool AMFComponentImpl::pauseDrain() {
+	HANDLE thread;
+	{
+		std::unique_lock lock(outputLock);
+		thread = drainThread;
+		draining = false;
+		inputReady.notify_all();
+	}
+	if(thread == nullptr) return false;
+
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+
+	std::unique_lock lock(outputLock);
+	drainThread = nullptr;
+	return true;
+}
+
+void AMFComponentImpl::stopDrain() {
+	if(!pauseDrain()) return;
+
+	std::unique_lock lock(outputLock);
+	for(Output &output : outputs) {
+		if(output.data != nullptr) output.data->Release();
+	}
+	outputs.clear();
+	inFlight = 0;
+}
+
+DWORD WINAPI AMFComponentImpl::drainMain(LPVOID arg) {
+	AMFComponentImpl *self = (AMFComponentImpl*)arg;
+	wineThread = true;
+	std::unique_lock lock(self->outputLock);
+
+	while(true) {
+		// Nothing to wait for until something has been submitted
+		self->inputReady.wait(lock, [self]{ return !self->draining || self->inFlight > 0; });
+		if(!self->draining) break;
+
+		lock.unlock();
+		amf::AMFData *data = nullptr;
+		AMF_RESULT ret;
+		{
+			ZoneScopedN("Drain");
+			ret = self->inner->QueryOutput(&data);
+		}
+		// The encoder might have let go of some inputs on its own threads
+		self->ourContext->collectReleased();
+		if(data != nullptr) {
+			self->outputDone(data);
+		} else if(ret == AMF_RESULT::AMF_EOF) {
+			self->allOutputsDone();
+		}
+		lock.lock();
+
+		if(data != nullptr) {
+			WINE_TRACE("Drained buffer of type %d\n", data->GetMemoryType());
+		} else if(ret == AMF_RESULT::AMF_REPEAT || ret == AMF_RESULT::AMF_OK) {
+			// In case the encoder doesn't do QueryTimeout
+			self->inputReady.wait_for(lock, std::chrono::milliseconds(1));
+			continue;
+		}
+
+		self->outputs.push_back(Output{
+			.result = ret,
+			.data = data,
+		});
+		self->outputReady.notify_one();
+
+		if(data == nullptr) {
+			// EOF or an error, the driver gets to see it. Don't keep asking
+			self->inFlight = 0;
+		} else if(self->inFlight > 0) {
+			self->inFlight--;
+		}
+	}
+
+	return 0;
 }
 
-uint32_t imgid = 0;
 MSABI AMF_RESULT AMFComponentImpl::SubmitInput(amf::AMFData* pData) {
 	ZoneScoped;
 	WINE_TRACE("(%p)\n", pData);
+	wineThread = true;
 
 	auto dataImpl = (AMFDataImpl*)pData;
 	trace->TraceW((wchar_t*)U"main", 3232, AMF_TRACE_INFO, (wchar_t*)U"AS", 0, (wchar_t*)U"Submit some input!");
 	WINE_TRACE("Got buffer of type %d\n", dataImpl->inner->GetMemoryType());
 
 	AMFSurfaceImpl *data = (AMFSurfaceImpl*)dataImpl;
-
-	IDXGIVkInteropSurface *dxvkSurface;
-	IDXGIVkInteropDevice *vkDev = nullptr;
-	if(data->d3dTexture->QueryInterface(__uuidof(IDXGIVkInteropSurface), (void**)&dxvkSurface) == 0) {
-		WINE_TRACE("YES. Surface is from dxvk!\n");
-		dxvkSurface->GetDevice(&vkDev);
-		IDXGIVkInteropDevice2 *vkDevTwo = nullptr;
-		if(vkDev->QueryInterface(__uuidof(IDXGIVkInteropDevice2), (void**)&vkDevTwo) == 0) {
-			vkDevTwo->GetSemaphores(&data->surface->Sync.hSemaphore, nullptr);
-			data->surface->Sync.bSubmitted = true;
-		} else {
-			WINE_ERR("Could not get the semaphores from the dxvk device");
-			data->surface->Sync.hSemaphore = nullptr;
-			data->surface->Sync.bSubmitted = false;
+	uint64_t id = 0;
+	if(data->context != nullptr) {
+		// The texture has one binary semaphore. If its last frame is still in
+		// the encoder, our signal could eat the one the encoder is about to
+		// wait on, so the driver has to take some output first.
+		bool idle = false;
+		if(!data->inEncoder.compare_exchange_strong(idle, true)) {
+			WINE_TRACE("Surface %p is still in the encoder\n", data);
+			WINE_TRACE("=> %d\n", AMF_RESULT::AMF_INPUT_FULL);
+			return AMF_RESULT::AMF_INPUT_FULL;
 		}
+		// The encoder's reference, until its output is out. It's queued
+		// before the submit so the output can't beat us to it.
+		((AMFInterfaceImpl*)data)->refs++;
+		{
+			std::unique_lock lock(outputLock);
+			id = ++submissions;
+			submitted.push_back(Submission{
+				.id = id,
+				.surface = data,
+			});
+		}
+		data->inner->SetProperty(SubmissionProperty, (amf_int64)id);
+
+		// The encoder waits on the surface's semaphore on its own queue, so
+		// dxvk can keep submitting while we encode
+		data->context->signalSurface(data);
+	}
 
-		vkDev->FlushRenderingCommands();
-		vkDev->LockSubmissionQueue();
-
-// 		VkInstance instance = 0;
-// 		VkPhysicalDevice physicalDevice = 0;
-// 		VkDevice device = 0;
-// 		vkDev->GetVulkanHandles(&instance, &physicalDevice, &device);
-// 		instance = (VkInstance)wine_unwrap_instance(instance);
-// 		physicalDevice = (VkPhysicalDevice)wine_unwrap_phys_dev(physicalDevice);
-// 		device = (VkDevice)wine_unwrap_device(device);
-// 		WINE_TRACE("Vulkan handles after unwrap %p %p %p\n", device, queue, physicalDevice);
-
-// 		VkQueue queue;
-// 		uint32_t queueFamily;
-// 		vkDev->GetSubmissionQueue(&queue, &queueFamily);
-// 		queue = (VkQueue)wine_unwrap_queue(queue);
-
-		/* VkImage image; */
-		/* VkImageLayout layout; */
-		/* VkImageCreateInfo createInfo = { */
-		/* 	.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO, */
-		/* 	.pNext = nullptr, */
-		/* 	.queueFamilyIndexCount = 0, */
-		/* 	.pQueueFamilyIndices = nullptr, */
-		/* }; */
-		/* dxvkSurface->GetVulkanImageInfo(&image, &layout, &createInfo); */
-		
-		/* VkDeviceMemory memory; */
-		/* VkDeviceSize size; */
-		/* dxvkSurface->GetVulkanDeviceMemory(&memory, &size); */
-
-		/* char filename[32]; */
-		/* sprintf(filename, "img/%d.dat", imgid++); */
-		/* FILE *f; */
-		/* /1* FILE *f = fopen(filename, "w"); *1/ */
-
-		/* memory = (VkDeviceMemory)wine_unwrap_dev_mem(memory); */
-		/* WINE_TRACE("Image extent %ux%u layout %d tiling %d\n", createInfo.extent.width, createInfo.extent.height, createInfo.format, createInfo.tiling); */
-		/* saveScreenshot(f, instance, device, queue, queueFamily, physicalDevice, createInfo.format, image, createInfo.extent.width, createInfo.extent.height, createInfo.tiling, memory, size); */
-
-		// We are clearly missing synchronization somewhere. But where?
-		// This at least gives me video output.
-		/* usleep(20000); */
-
-		/* fclose(f); */
-	}
-
-	/* WINE_TRACE("Real amf surface %p\n", data->inner.get()); */
 	auto ret = inner->SubmitInput(dataImpl->inner.get());
+	ourContext->collectReleased();
 
-	if(vkDev != nullptr) vkDev->ReleaseSubmissionQueue();
+	if(ret == AMF_RESULT::AMF_OK) {
+		std::unique_lock lock(outputLock);
+		if(drainThread != nullptr) {
+			inFlight++;
+			inputReady.notify_one();
+		}
+	} else if(data->context != nullptr) {
+		// It never made it in
+		bool found = false;
+		{
+			std::unique_lock lock(outputLock);
+			for(auto it = submitted.begin(); it != submitted.end(); it++) {
+				if(it->id != id) continue;
+				submitted.erase(it);
+				found = true;
+				break;
+			}
+		}
+		if(found) {
+			data->inEncoder = false;
+			((AMFInterfaceImpl*)data)->Release();
+		}
+	}
 
 	WINE_TRACE("=> %d\n", ret);
 	return ret;
@@ -1426,8 +2520,37 @@ MSABI AMF_RESULT AMFComponentImpl::SubmitInput(amf::AMFData* pData) {
 MSABI AMF_RESULT AMFComponentImpl::QueryOutput(amf::AMFData** ppData) {
 	ZoneScoped;
 	WINE_TRACE("(%p)\n", ppData);
+	wineThread = true;
+	if(allocator != nullptr) allocator->collect();
+	ourContext->collectReleased();
 
-	AMF_RESULT ret = inner->QueryOutput(ppData);
+	AMF_RESULT ret;
+	{
+		std::unique_lock lock(outputLock);
+		// There can be something queued from a ReInit even without the
+		// thread
+		if(drainThread == nullptr && outputs.empty()) {
+			lock.unlock();
+			ret = inner->QueryOutput(ppData);
+			if(*ppData != nullptr) {
+				outputDone(*ppData);
+			} else if(ret == AMF_RESULT::AMF_EOF) {
+				allOutputsDone();
+			}
+		} else {
+			if(outputs.empty() && queryTimeout > 0) {
+				outputReady.wait_for(lock, std::chrono::milliseconds(queryTimeout), [this]{ return !outputs.empty(); });
+			}
+			if(outputs.empty()) {
+				*ppData = nullptr;
+				ret = AMF_RESULT::AMF_REPEAT;
+			} else {
+				*ppData = outputs.front().data;
+				ret = outputs.front().result;
+				outputs.pop_front();
+			}
+		}
+	}
 	if(*ppData == nullptr) goto done;
 
 	WINE_TRACE("Got buffer of type %d\n", (*ppData)->GetMemoryType());
@@ -1438,7 +2561,7 @@ MSABI AMF_RESULT AMFComponentImpl::QueryOutput(amf::AMFData** ppData) {
 		// fflush(videofile);
 	// }
 
-	*ppData = (amf::AMFData*)new AMFDataImpl(std::shared_ptr<amf::AMFData>(*ppData));
+	*ppData = (amf::AMFData*)WrapperPool<AMFDataImpl>::make(unowned(*ppData));
 
 done:
 	WINE_TRACE("=> %d\n", ret);
@@ -1449,8 +2572,26 @@ MSABI amf::AMFContext* AMFComponentImpl::GetContext() {
 	return nullptr;
 }
 MSABI AMF_RESULT AMFComponentImpl::SetOutputDataAllocatorCB(amf::AMFDataAllocatorCB* callback) {
-	STUB();
-	return AMF_RESULT::AMF_FAIL;
+	ZoneScoped;
+	WINE_TRACE("(%p)\n", callback);
+	wineThread = true;
+
+	AllocatorBridge *bridge = nullptr;
+	if(callback != nullptr) bridge = new AllocatorBridge((WinDataAllocatorCB*)callback, context);
+
+	AMF_RESULT ret = inner->SetOutputDataAllocatorCB(bridge);
+	if(ret != AMF_RESULT::AMF_OK) {
+		if(bridge != nullptr) bridge->Release();
+		goto done;
+	}
+
+	// The encoder holds its own reference
+	if(allocator != nullptr) allocator->Release();
+	allocator = bridge;
+
+done:
+	WINE_TRACE("=> %d\n", ret);
+	return ret;
 }
 
 MSABI AMF_RESULT AMFComponentImpl::GetCaps(amf::AMFCaps** ppCaps) {
@@ -1580,17 +2721,159 @@ AMF_RESULT MSABI AMFFactoryImpl::CreateContext(amf::AMFContext** ppContext) {
 	WINE_TRACE("(%p) => %d\n", ppContext, ret);
 	return ret;
 }
+struct PolicySection {
+	std::wstring component;
+	std::vector<PolicyRule> rules;
+};
+static std::vector<PolicySection> policySections;
+
+static bool parsePolicyValue(const char *str, amf::AMFVariantStruct *value) {
+	memset(value, 0, sizeof(*value));
+	if(strcmp(str, "true") == 0 || strcmp(str, "false") == 0) {
+		value->type = amf::AMF_VARIANT_BOOL;
+		value->boolValue = str[0] == 't';
+		return true;
+	}
+
+	char *end;
+	long long integer = strtoll(str, &end, 0);
+	if(end != str && *end == '\0') {
+		value->type = amf::AMF_VARIANT_INT64;
+		value->int64Value = integer;
+		return true;
+	}
+	double real = strtod(str, &end);
+	if(end != str && *end == '\0') {
+		value->type = amf::AMF_VARIANT_DOUBLE;
+		value->doubleValue = real;
+		return true;
+	}
+	return false;
+}
+
+static char *trimPolicy(char *str) {
+	while(isspace(*str)) str++;
+	char *end = str + strlen(str);
+	while(end > str && isspace(end[-1])) end--;
+	*end = '\0';
+	return str;
+}
+
+// The file named by VRLINK_AMF_POLICY has sections named after the
+// component they apply to, or * for all of them. In there each line is a
+// property name, an operator and a value. = forces the value, <= and >=
+// clamp whatever the driver sets. # starts a comment.
+static void loadPolicy() {
+	const char *path = getenv("VRLINK_AMF_POLICY");
+	if(path == nullptr) return;
+
+	FILE *f = fopen(path, "r");
+	if(f == nullptr) {
+		WINE_ERR("Couldn't open the policy file %s\n", path);
+		return;
+	}
+
+	char buf[512];
+	int lineNo = 0;
+	PolicySection *section = nullptr;
+	while(fgets(buf, sizeof(buf), f) != nullptr) {
+		lineNo++;
+		char *comment = strchr(buf, '#');
+		if(comment != nullptr) *comment = '\0';
+		char *line = trimPolicy(buf);
+		if(*line == '\0') continue;
+
+		if(*line == '[') {
+			char *close = strchr(line, ']');
+			if(close == nullptr) {
+				WINE_ERR("%s:%d: Section isn't closed\n", path, lineNo);
+				section = nullptr;
+				continue;
+			}
+			*close = '\0';
+			char *name = trimPolicy(line + 1);
+			section = &policySections.emplace_back();
+			section->component.assign(name, name + strlen(name));
+			continue;
+		}
+
+		if(section == nullptr) {
+			WINE_ERR("%s:%d: Rule outside of a section\n", path, lineNo);
+			continue;
+		}
+
+		PolicyRule rule;
+		char *op = strpbrk(line, "<>=");
+		if(op == nullptr) {
+			WINE_ERR("%s:%d: Expected =, <= or >=\n", path, lineNo);
+			continue;
+		}
+		char *valueStr;
+		if(*op == '=') {
+			rule.op = PolicyRule::Force;
+			valueStr = op + 1;
+		} else if(op[1] == '=') {
+			rule.op = *op == '<' ? PolicyRule::AtMost : PolicyRule::AtLeast;
+			valueStr = op + 2;
+		} else {
+			WINE_ERR("%s:%d: Expected =, <= or >=\n", path, lineNo);
+			continue;
+		}
+		*op = '\0';
+		char *name = trimPolicy(line);
+		valueStr = trimPolicy(valueStr);
+		if(*name == '\0') {
+			WINE_ERR("%s:%d: Rule without a property name\n", path, lineNo);
+			continue;
+		}
+
+		if(!parsePolicyValue(valueStr, &rule.value)) {
+			WINE_ERR("%s:%d: %s isn't a number or a bool\n", path, lineNo, valueStr);
+			continue;
+		}
+		if(rule.op != PolicyRule::Force && rule.value.type == amf::AMF_VARIANT_BOOL) {
+			WINE_ERR("%s:%d: Can't clamp a bool\n", path, lineNo);
+			continue;
+		}
+
+		std::u16string winName(name, name + strlen(name));
+		rule.name = internWinWStr(winName.c_str());
+		section->rules.push_back(rule);
+	}
+	fclose(f);
+
+	WINE_TRACE("Loaded %lu policy sections from %s\n", policySections.size(), path);
+}
+
+static std::vector<PolicyRule> policyFor(const wchar_t *component) {
+	std::vector<PolicyRule> rules;
+	for(const PolicySection &section : policySections) {
+		if(section.component != L"*" && section.component != component) continue;
+		rules.insert(rules.end(), section.rules.begin(), section.rules.end());
+	}
+	return rules;
+}
+
 AMF_RESULT MSABI AMFFactoryImpl::CreateComponent(amf::AMFContext* pContext, const char16_t* id, amf::AMFComponent** ppComponent) {
 	AMFContextImpl *ourContext = (AMFContextImpl*)pContext;
-	char32_t *linuxId = winWStrToLinux(id);
+	const wchar_t *linuxId = internWinWStr(id);
 	WINE_TRACE("(%p %ls %p)\n", pContext, linuxId, ppComponent);
 
 	amf::AMFComponent *realComponent;
-	AMF_RESULT ret = inner->CreateComponent(ourContext->inner.get(), (wchar_t*)linuxId, &realComponent);
-	/* free(linuxId); */
+	AMF_RESULT ret = inner->CreateComponent(ourContext->inner.get(), linuxId, &realComponent);
 
 	if(ret == AMF_RESULT::AMF_OK) {
-		*ppComponent = (amf::AMFComponent*)new AMFComponentImpl(std::shared_ptr<amf::AMFComponent>(realComponent), this->trace->inner.get());
+		std::vector<PolicyRule> policy = policyFor(linuxId);
+		// Forced values go in now, in case the driver never sets them
+		for(const PolicyRule &rule : policy) {
+			if(rule.op != PolicyRule::Force) continue;
+			if(realComponent->SetProperty(rule.name, rule.value) != AMF_RESULT::AMF_OK) {
+				WINE_ERR("Policy couldn't set %ls on %ls\n", rule.name, linuxId);
+			} else {
+				WINE_WARN("Policy set %ls on %ls\n", rule.name, linuxId);
+			}
+		}
+		*ppComponent = (amf::AMFComponent*)new AMFComponentImpl(std::shared_ptr<amf::AMFComponent>(realComponent), this->trace->inner.get(), ourContext, std::move(policy));
 	}
 
 	WINE_TRACE("=> %d\n", ret);
@@ -1665,6 +2948,7 @@ DLL_EXPORT AMF_RESULT AMFInit(uint64_t version, amf::AMFFactory **out) {
 		AMF_RESULT res = initfn(version, &realFactory);
 		assert(res == AMF_RESULT::AMF_OK);
 		factory = new AMFFactoryImpl(realFactory);
+		loadPolicy();
 	}
 
 	*out = (amf::AMFFactory*)factory;
@@ -8,7 +8,11 @@
 #pragma pop_macro("_WIN32")
 
 #include "ipc.h"
+#include "shm.h"
+#include "fence.h"
 #include <cassert>
+#include <chrono>
+#include <set>
 #include <openvr_driver.h>
 #include <windows.h>
 #include <wine/windows/d3d11.h>
@@ -16,17 +20,13 @@
 #include <ntstatus.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <unistd.h>
 #include <d3d11_4.h>
 
 #include <wine/debug.h>
 
 WINE_DEFAULT_DEBUG_CHANNEL(dllhost);
 
-struct DriverState {
-	Pipe pipe;
-	HINSTANCE hDLL;
-};
-
 
 typedef unsigned int obj_handle_t;
 
@@ -53,8 +53,50 @@ struct DxvkSharedTextureMetadata {
 	UINT             CPUAccessFlags;
 	UINT             MiscFlags;
 	UINT             RowPitch;
+	// The modifier dxvk allocated with
 	uint64_t         DRMFormat;
 	D3D11_TEXTURE_LAYOUT TextureLayout;
+	// Only there if dxvk shares layouts with more than one plane, older
+	// builds stop before this. RowPitch is the first plane's stride.
+	UINT             PlaneCount;
+	UINT             PlaneOffsets[4];
+	UINT             PlaneStrides[4];
+};
+
+// What we got out of a KMT handle. The fd is owned by the cache
+struct SharedResource {
+	int fd;
+	DxvkSharedTextureMetadata metadata;
+	// How many exported sets use it. Sets can share textures.
+	uint32_t refs;
+};
+
+// The textures of a set we have exported, so the cache entries can be
+// dropped when the set goes away
+struct ExportedSet {
+	uint32_t pid;
+	HANDLE handles[3];
+	// Which of them the set holds a cache reference on
+	bool held[3];
+};
+
+struct DriverState {
+	Pipe pipe;
+	HINSTANCE hDLL;
+
+	std::mutex timingLock;
+	std::map<vr::IVRDriverDirectModeComponent*, FrameTimingSlot*> timing;
+	// Frames presented before their fences signalled
+	std::atomic<uint64_t> fenceTimeouts = 0;
+
+	// Property containers the native side gave us, so component creates
+	// can fail up front instead of handing out a dead promise
+	std::mutex containersLock;
+	std::set<vr::PropertyContainerHandle_t> containers;
+
+	std::mutex resourcesLock;
+	std::map<HANDLE, struct SharedResource> resources;
+	std::vector<struct ExportedSet> exportedSets;
 };
 
 #define IOCTL_SHARED_GPU_RESOURCE_SET_METADATA           CTL_CODE(FILE_DEVICE_VIDEO, 4, METHOD_BUFFERED, FILE_WRITE_ACCESS)
@@ -87,31 +129,29 @@ struct shared_resource_info
     UINT64 resource_size;
 };
 
-static inline void init_unicode_string( UNICODE_STRING *str, const WCHAR *data ) {
-    str->Length = lstrlenW(data) * sizeof(WCHAR);
-    str->MaximumLength = str->Length + sizeof(WCHAR);
-    str->Buffer = (WCHAR *)data;
-}
-
 static HANDLE open_shared_resource(HANDLE kmt_handle, LPCWSTR name) {
-    static const WCHAR shared_gpu_resourceW[] = {'\\','?','?','\\','S','h','a','r','e','d','G','p','u','R','e','s','o','u','r','c','e',0};
-    UNICODE_STRING shared_gpu_resource_us;
+    static WCHAR shared_gpu_resourceW[] = {'\\','?','?','\\','S','h','a','r','e','d','G','p','u','R','e','s','o','u','r','c','e',0};
+    static UNICODE_STRING shared_gpu_resource_us = {
+        sizeof(shared_gpu_resourceW) - sizeof(WCHAR),
+        sizeof(shared_gpu_resourceW),
+        shared_gpu_resourceW,
+    };
+    static OBJECT_ATTRIBUTES attr = {
+        sizeof(attr),
+        0,
+        &shared_gpu_resource_us,
+        0,
+        NULL,
+        NULL,
+    };
     struct shared_resource_open *inbuff;
     HANDLE shared_resource;
-    OBJECT_ATTRIBUTES attr;
     IO_STATUS_BLOCK iosb;
     NTSTATUS status;
     DWORD in_size;
 
-    init_unicode_string(&shared_gpu_resource_us, shared_gpu_resourceW);
-
-    attr.Length = sizeof(attr);
-    attr.RootDirectory = 0;
-    attr.Attributes = 0;
-    attr.ObjectName = &shared_gpu_resource_us;
-    attr.SecurityDescriptor = NULL;
-    attr.SecurityQualityOfService = NULL;
-
+    // Wine binds the resource to the file handle on open, so every resource
+    // needs a device handle of its own.
     if ((status = NtCreateFile(&shared_resource, GENERIC_READ | GENERIC_WRITE, &attr, &iosb, NULL, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_OPEN, 0, NULL, 0))) {
         WINE_ERR("Failed to load open a shared resource handle, status %#lx.\n", (long int)status);
         return INVALID_HANDLE_VALUE;
@@ -150,30 +190,111 @@ struct shared_resource_create
 };
 
 extern "C" NTSYSAPI NTSTATUS CDECL wine_server_handle_to_fd( HANDLE handle, unsigned int access, int *unix_fd, unsigned int *options );
-static int get_shared_resource_fd(HANDLE shared_resource, struct DriverState *state, uint32_t *rowPitch) {
+static bool export_shared_resource(HANDLE kmt_handle, struct SharedResource *resource) {
 	IO_STATUS_BLOCK iosb;
 	uint32_t unix_resource;
 	NTSTATUS status;
-	int ret;
+	HANDLE shared_resource;
 
-	shared_resource = open_shared_resource( shared_resource, nullptr );
+	shared_resource = open_shared_resource( kmt_handle, nullptr );
 	if(shared_resource == INVALID_HANDLE_VALUE) {
-		return -1;
+		return false;
 	}
 
-	DxvkSharedTextureMetadata metadata;
-	getSharedMetadata(shared_resource, &metadata, sizeof(metadata), nullptr);
-    assert(metadata.DRMFormat == DRM_FORMAT_MOD_LINEAR);
-	*rowPitch = metadata.RowPitch;
-	WINE_TRACE("    0x%08lX -> %d %d %d %d %lu %d\n", (uint64_t)shared_resource, metadata.Width, metadata.Height, metadata.Format, metadata.SampleDesc.Quality, metadata.DRMFormat, metadata.TextureLayout);
+	// dxvk picks the layout when it allocates and leaves the modifier it
+	// chose in the metadata
+	uint32_t metadataSize = 0;
+	memset(&resource->metadata, 0, sizeof(resource->metadata));
+	getSharedMetadata(shared_resource, &resource->metadata, sizeof(resource->metadata), &metadataSize);
+	if(metadataSize < sizeof(resource->metadata) || resource->metadata.PlaneCount == 0) {
+		resource->metadata.PlaneCount = 1;
+		resource->metadata.PlaneOffsets[0] = 0;
+		resource->metadata.PlaneStrides[0] = resource->metadata.RowPitch;
+	}
+	WINE_TRACE("    0x%08lX -> %d %d %d %d %lx %d\n", (uint64_t)kmt_handle, resource->metadata.Width, resource->metadata.Height, resource->metadata.Format, resource->metadata.SampleDesc.Quality, resource->metadata.DRMFormat, resource->metadata.TextureLayout);
 
-	if (NtDeviceIoControlFile(shared_resource, NULL, NULL, NULL, &iosb, IOCTL_SHARED_GPU_RESOURCE_GET_DMA_RESOURCE,
-				NULL, 0, &unix_resource, sizeof(unix_resource)))
-		return -1;
+	status = NtDeviceIoControlFile(shared_resource, NULL, NULL, NULL, &iosb, IOCTL_SHARED_GPU_RESOURCE_GET_DMA_RESOURCE,
+				NULL, 0, &unix_resource, sizeof(unix_resource));
+	// The dmabuf keeps the memory alive, we don't need the resource after this
+	NtClose(shared_resource);
+	if(status)
+		return false;
 
-	status = wine_server_handle_to_fd(wine_server_ptr_handle(unix_resource), FILE_READ_DATA, &ret, NULL);
+	status = wine_server_handle_to_fd(wine_server_ptr_handle(unix_resource), FILE_READ_DATA, &resource->fd, NULL);
 	NtClose(wine_server_ptr_handle(unix_resource));
-	return status == 0 ? ret : -1;
+	return status == 0;
+}
+
+static void release_shared_resource(struct DriverState *state, HANDLE handle) {
+	auto it = state->resources.find(handle);
+	if(it == state->resources.end()) return;
+	if(--it->second.refs != 0) return;
+	close(it->second.fd);
+	state->resources.erase(it);
+}
+
+// Converts all the textures of a swap set. Textures we've seen before come
+// out of the cache. The set is remembered even if some of it fails to
+// export, forget_swap_set cleans up after it either way.
+static bool get_swap_set_resources(struct DriverState *state, uint32_t pid, const vr::SharedTextureHandle_t handles[3], struct SharedResource resources[3]) {
+	std::unique_lock lock(state->resourcesLock);
+	struct ExportedSet set;
+	set.pid = pid;
+
+	bool ok = true;
+	for(uint8_t i = 0; i < 3; i++) {
+		HANDLE handle = (HANDLE)handles[i];
+		set.handles[i] = handle;
+		set.held[i] = false;
+
+		auto it = state->resources.find(handle);
+		if(it != state->resources.end()) {
+			it->second.refs++;
+			set.held[i] = true;
+			resources[i] = it->second;
+			continue;
+		}
+
+		if(!export_shared_resource(handle, &resources[i])) {
+			resources[i].fd = -1;
+			ok = false;
+			continue;
+		}
+		resources[i].refs = 1;
+		set.held[i] = true;
+		state->resources[handle] = resources[i];
+	}
+	state->exportedSets.push_back(set);
+	return ok;
+}
+
+// Any of the handles identifies the set, same as DestroySwapTextureSet
+static void forget_swap_set(struct DriverState *state, vr::SharedTextureHandle_t handle) {
+	std::unique_lock lock(state->resourcesLock);
+	for(auto it = state->exportedSets.begin(); it != state->exportedSets.end(); it++) {
+		if(it->handles[0] != (HANDLE)handle && it->handles[1] != (HANDLE)handle && it->handles[2] != (HANDLE)handle)
+			continue;
+		for(uint8_t i = 0; i < 3; i++) {
+			if(it->held[i]) release_shared_resource(state, it->handles[i]);
+		}
+		state->exportedSets.erase(it);
+		return;
+	}
+}
+
+static void forget_swap_sets_of(struct DriverState *state, uint32_t pid) {
+	std::unique_lock lock(state->resourcesLock);
+	auto it = state->exportedSets.begin();
+	while(it != state->exportedSets.end()) {
+		if(it->pid != pid) {
+			it++;
+			continue;
+		}
+		for(uint8_t i = 0; i < 3; i++) {
+			if(it->held[i]) release_shared_resource(state, it->handles[i]);
+		}
+		it = state->exportedSets.erase(it);
+	}
 }
 
 #define STUB() \
@@ -275,6 +396,11 @@ void *nullspot[] = {
 	(void*)&uhoh,
 };
 
+static bool known_container(struct DriverState *state, vr::PropertyContainerHandle_t container) {
+	std::unique_lock lock(state->containersLock);
+	return state->containers.count(container) != 0;
+}
+
 class VRDriverInput : public vr::IVRDriverInput {
 	uint64_t objId;
 	struct DriverState *state;
@@ -298,28 +424,33 @@ public:
 MSABI vr::EVRInputError VRDriverInput::CreateBooleanComponent( vr::PropertyContainerHandle_t ulContainer, const char *pchName, vr::VRInputComponentHandle_t *pHandle ) {
 	WINE_TRACE("call CreateBooleanComponent(%ld, %s, %p)\n", ulContainer, pchName, pHandle);
 	ZoneScoped;
+	// Catch what we can before the call goes out, the rest fails once the
+	// handle is used
+	if(pchName == nullptr || pHandle == nullptr) return vr::VRInputError_InvalidParam;
+	if(!known_container(state, ulContainer)) return vr::VRInputError_InvalidHandle;
 	state->pipe.begin_call(METH_INPUT_CBOOL);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&ulContainer, sizeof(ulContainer));
 	size_t nameLen = strlen(pchName);
 	state->pipe.send(&nameLen, sizeof(nameLen));
 	state->pipe.send(pchName, nameLen);
+	// The handle is a promise, so the driver can go on creating components
+	// without waiting on each one. If the create fails, the promise resolves
+	// to the invalid handle and updates return VRInputError_InvalidHandle.
+	uint64_t promise = state->pipe.new_promise();
+	state->pipe.send_varint(promise);
 
-	state->pipe.wait_for_return();
+	state->pipe.send_detached();
 
-	vr::EVRInputError ret;
-	state->pipe.recv(&ret, sizeof(ret));
-	state->pipe.recv(pHandle, sizeof(*pHandle));
-	state->pipe.return_read_channel();
-
-	WINE_TRACE("ret %d, %ld\n", ret, *pHandle);
-	return ret;
+	*pHandle = promise;
+	WINE_TRACE("ret promise %lx\n", *pHandle);
+	return vr::VRInputError_None;
 }
 MSABI vr::EVRInputError VRDriverInput::UpdateBooleanComponent( vr::VRInputComponentHandle_t ulComponent, bool bNewValue, double fTimeOffset ) {
 	// WINE_TRACE("call UpdateBooleanComponent(%ld, %d, %lf)\n", ulComponent, bNewValue, fTimeOffset);
 	// ZoneScoped;
 	state->pipe.begin_call(METH_INPUT_UBOOL);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&ulComponent, sizeof(ulComponent));
 	state->pipe.send(&bNewValue, sizeof(bNewValue));
 	state->pipe.send(&fTimeOffset, sizeof(fTimeOffset));
@@ -336,30 +467,30 @@ MSABI vr::EVRInputError VRDriverInput::UpdateBooleanComponent( vr::VRInputCompon
 MSABI vr::EVRInputError VRDriverInput::CreateScalarComponent( vr::PropertyContainerHandle_t ulContainer, const char *pchName, vr::VRInputComponentHandle_t *pHandle, vr::EVRScalarType eType, vr::EVRScalarUnits eUnits ) {
 	WINE_TRACE("call CreateScalarComponent(%ld, %s, %p)\n", ulContainer, pchName, pHandle);
 	ZoneScoped;
+	if(pchName == nullptr || pHandle == nullptr) return vr::VRInputError_InvalidParam;
+	if(!known_container(state, ulContainer)) return vr::VRInputError_InvalidHandle;
 	state->pipe.begin_call(METH_INPUT_CSCALAR);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&ulContainer, sizeof(ulContainer));
 	size_t nameLen = strlen(pchName);
 	state->pipe.send(&nameLen, sizeof(nameLen));
 	state->pipe.send(pchName, nameLen);
 	state->pipe.send(&eType, sizeof(eType));
 	state->pipe.send(&eUnits, sizeof(eUnits));
+	uint64_t promise = state->pipe.new_promise();
+	state->pipe.send_varint(promise);
 
-	state->pipe.wait_for_return();
-
-	vr::EVRInputError ret;
-	state->pipe.recv(&ret, sizeof(ret));
-	state->pipe.recv(pHandle, sizeof(*pHandle));
-	state->pipe.return_read_channel();
+	state->pipe.send_detached();
 
-	WINE_TRACE("ret %d, %ld\n", ret, *pHandle);
-	return ret;
+	*pHandle = promise;
+	WINE_TRACE("ret promise %lx\n", *pHandle);
+	return vr::VRInputError_None;
 }
 MSABI vr::EVRInputError VRDriverInput::UpdateScalarComponent( vr::VRInputComponentHandle_t ulComponent, float fNewValue, double fTimeOffset ) {
 	// WINE_TRACE("call UpdateScalarComponent(%ld, %f, %lf)\n", ulComponent, fNewValue, fTimeOffset);
 	// ZoneScoped;
 	state->pipe.begin_call(METH_INPUT_USCALAR);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&ulComponent, sizeof(ulComponent));
 	state->pipe.send(&fNewValue, sizeof(fNewValue));
 	state->pipe.send(&fTimeOffset, sizeof(fTimeOffset));
@@ -376,22 +507,22 @@ MSABI vr::EVRInputError VRDriverInput::UpdateScalarComponent( vr::VRInputCompone
 MSABI vr::EVRInputError VRDriverInput::CreateHapticComponent( vr::PropertyContainerHandle_t ulContainer, const char *pchName, vr::VRInputComponentHandle_t *pHandle ) {
 	WINE_TRACE("call CreateHapticComponent(%ld, %s, %p)\n", ulContainer, pchName, pHandle);
 	ZoneScoped;
+	if(pchName == nullptr || pHandle == nullptr) return vr::VRInputError_InvalidParam;
+	if(!known_container(state, ulContainer)) return vr::VRInputError_InvalidHandle;
 	state->pipe.begin_call(METH_INPUT_CHAPTIC);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&ulContainer, sizeof(ulContainer));
 	size_t nameLen = strlen(pchName);
 	state->pipe.send(&nameLen, sizeof(nameLen));
 	state->pipe.send(pchName, nameLen);
+	uint64_t promise = state->pipe.new_promise();
+	state->pipe.send_varint(promise);
 
-	state->pipe.wait_for_return();
+	state->pipe.send_detached();
 
-	vr::EVRInputError ret;
-	state->pipe.recv(&ret, sizeof(ret));
-	state->pipe.recv(pHandle, sizeof(*pHandle));
-	state->pipe.return_read_channel();
-
-	WINE_TRACE("ret %d, %ld\n", ret, *pHandle);
-	return ret;
+	*pHandle = promise;
+	WINE_TRACE("ret promise %lx\n", *pHandle);
+	return vr::VRInputError_None;
 }
 MSABI vr::EVRInputError VRDriverInput::CreateSkeletonComponent( vr::PropertyContainerHandle_t ulContainer, const char *pchName, const char *pchSkeletonPath, const char *pchBasePosePath, vr::EVRSkeletalTrackingLevel eSkeletalTrackingLevel, const vr::VRBoneTransform_t *pGripLimitTransforms, uint32_t unGripLimitTransformCount, vr::VRInputComponentHandle_t *pHandle ) {
 	STUB();
@@ -437,7 +568,7 @@ MSABI vr::vrmb_typeb VRMailbox::undoc1(const char *a, vr::vrmb_typea *b, char *c
 	WINE_TRACE("call undoc1(%s, %p, %s, %d)\n", a, b, c, d);
 	ZoneScoped;
 	state->pipe.begin_call(METH_MB_UNDOC1);
-	state->pipe.send(&objId, sizeof(uint64_t));
+	state->pipe.send_handle(objId);
 	uint64_t alen = strlen(a);
 	state->pipe.send(&alen, sizeof(uint64_t));
 	state->pipe.send(a, alen);
@@ -456,7 +587,7 @@ MSABI vr::vrmb_typeb VRMailbox::undoc2(vr::vrmb_typea a) {
 	WINE_TRACE("call undoc2(%ld)\n", a);
 	ZoneScoped;
 	state->pipe.begin_call(METH_MB_UNDOC2);
-	state->pipe.send(&objId, sizeof(uint64_t));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&a, sizeof(a));
 
 	state->pipe.wait_for_return();
@@ -470,7 +601,7 @@ MSABI vr::vrmb_typeb VRMailbox::undoc3(vr::vrmb_typea a, const char *b, const ch
 	WINE_TRACE("call undoc3(%ld, %p, %p, %d)\n", a, b, c, d);
 	ZoneScoped;
 	state->pipe.begin_call(METH_MB_UNDOC3);
-	state->pipe.send(&objId, sizeof(uint64_t));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&a, sizeof(a));
 	uint64_t blen = strlen(b);
 	state->pipe.send(&blen, sizeof(uint64_t));
@@ -491,7 +622,7 @@ MSABI vr::vrmb_typeb VRMailbox::undoc4(vr::vrmb_typea a, char *b, uint32_t c, ui
 	WINE_TRACE("call undoc4(%ld, %p, %d, %p)\n", a, b, c, d);
 	ZoneScoped;
 	state->pipe.begin_call(METH_MB_UNDOC4);
-	state->pipe.send(&objId, sizeof(uint64_t));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&a, sizeof(uint64_t));
 	state->pipe.send(&c, sizeof(uint32_t));
 
@@ -526,7 +657,7 @@ MSABI vr::ETrackedPropertyError VRPaths::ReadPathBatch(vr::PropertyContainerHand
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_PATH_READ);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&ulRootHandle, sizeof(uint64_t));
 
 	state->pipe.send(&unBatchEntryCount, sizeof(unBatchEntryCount));
@@ -562,7 +693,7 @@ MSABI vr::ETrackedPropertyError VRPaths::WritePathBatch(vr::PropertyContainerHan
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_PATH_WRITE);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&ulRootHandle, sizeof(uint64_t));
 
 	state->pipe.send(&unBatchEntryCount, sizeof(unBatchEntryCount));
@@ -601,7 +732,7 @@ MSABI vr::ETrackedPropertyError VRPaths::StringToHandle(vr::PathHandle_t * pHand
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_PATH_S2H);
-	state->pipe.send(&objId, sizeof(uint64_t));
+	state->pipe.send_handle(objId);
 	uint64_t pathLen = strlen(pchPath);
 	state->pipe.send(&pathLen, sizeof(uint64_t));
 	state->pipe.send(pchPath, pathLen);
@@ -648,7 +779,7 @@ MSABI bool VRServerDriverHost::TrackedDeviceAdded(const char *pchDeviceSerialNum
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_SERVER_DEVADD);
-	state->pipe.send(&objId, sizeof(size_t));
+	state->pipe.send_handle(objId);
 	uint64_t len = strlen(pchDeviceSerialNumber);
 	state->pipe.send(&len, sizeof(len));
 	state->pipe.send(pchDeviceSerialNumber, len);
@@ -669,7 +800,7 @@ MSABI void VRServerDriverHost::TrackedDevicePoseUpdated(uint32_t unWhichDevice,
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_SERVER_POSE);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&unWhichDevice, sizeof(unWhichDevice));
 	state->pipe.send(&newPose, sizeof(newPose));
 
@@ -683,7 +814,7 @@ MSABI void VRServerDriverHost::VsyncEvent(double vsyncTimeOffsetSeconds) {
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_SERVER_VSYNC);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&vsyncTimeOffsetSeconds, sizeof(vsyncTimeOffsetSeconds));
 
 	state->pipe.wait_for_return();
@@ -695,7 +826,7 @@ MSABI void VRServerDriverHost::VendorSpecificEvent(uint32_t unWhichDevice, vr::E
 	WINE_TRACE("call VendorSpecificEvent(%d %d %p %lf)\n", unWhichDevice, eventType, &eventData, eventTimeOffset);
 
 	state->pipe.begin_call(METH_SERVER_VENDOR);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&unWhichDevice, sizeof(unWhichDevice));
 	state->pipe.send(&eventType, sizeof(eventType));
 	state->pipe.send(&eventData, sizeof(eventData));
@@ -716,7 +847,7 @@ MSABI bool VRServerDriverHost::PollNextEvent(vr::VREvent_t *pEvent, uint32_t unc
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_SERVER_POLL);
-	state->pipe.send(&objId, sizeof(size_t));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&uncbVREvent, sizeof(uncbVREvent));
 
 	state->pipe.wait_for_return();
@@ -747,7 +878,7 @@ MSABI void VRServerDriverHost::SetDisplayProjectionRaw(uint32_t unWhichDevice, c
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_SERVER_PROJ);
-	state->pipe.send(&objId, sizeof(size_t));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&unWhichDevice, sizeof(unWhichDevice));
 	state->pipe.send(&eyeLeft, sizeof(eyeLeft));
 	state->pipe.send(&eyeRight, sizeof(eyeRight));
@@ -819,7 +950,7 @@ MSABI bool VRSettings::GetBool(const char *pchSection, const char *pchSettingsKe
 	}
 
 	state->pipe.begin_call(METH_SETS_GBOOL);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	uint64_t sectionLen = strlen(pchSection);
 	state->pipe.send(&sectionLen, sizeof(sectionLen));
 	state->pipe.send(pchSection, sectionLen);
@@ -847,7 +978,7 @@ MSABI int32_t VRSettings::GetInt32(const char *pchSection, const char *pchSettin
 	}
 
 	state->pipe.begin_call(METH_SETS_GINT);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	uint64_t sectionLen = strlen(pchSection);
 	state->pipe.send(&sectionLen, sizeof(sectionLen));
 	state->pipe.send(pchSection, sectionLen);
@@ -875,7 +1006,7 @@ MSABI float VRSettings::GetFloat(const char *pchSection, const char *pchSettings
 	}
 
 	state->pipe.begin_call(METH_SETS_GFLT);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	uint64_t sectionLen = strlen(pchSection);
 	state->pipe.send(&sectionLen, sizeof(sectionLen));
 	state->pipe.send(pchSection, sectionLen);
@@ -903,7 +1034,7 @@ MSABI void VRSettings::GetString(const char *pchSection, const char *pchSettings
 	}
 
 	state->pipe.begin_call(METH_SETS_GSTR);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	uint64_t sectionLen = strlen(pchSection);
 	state->pipe.send(&sectionLen, sizeof(sectionLen));
 	state->pipe.send(pchSection, sectionLen);
@@ -951,7 +1082,7 @@ MSABI vr::ETrackedPropertyError VRProperties::ReadPropertyBatch(vr::PropertyCont
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_PROP_READ);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&ulContainerHandle, sizeof(uint64_t));
 
 	state->pipe.send(&unBatchEntryCount, sizeof(unBatchEntryCount));
@@ -988,7 +1119,7 @@ MSABI vr::ETrackedPropertyError VRProperties::WritePropertyBatch(vr::PropertyCon
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_PROP_WRITE);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&ulContainerHandle, sizeof(uint64_t));
 
 	state->pipe.send(&unBatchEntryCount, sizeof(unBatchEntryCount));
@@ -1026,8 +1157,10 @@ MSABI vr::PropertyContainerHandle_t VRProperties::TrackedDeviceToPropertyContain
 	WINE_TRACE("call TrackedDeviceToPropertyContainer(%d)\n", nDevice);
 	ZoneScoped;
 
+	// This one stays blocking so the driver sees a bad device right away.
+	// The component creates check against what we handed out here.
 	state->pipe.begin_call(METH_PROP_TRANS);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 	state->pipe.send(&nDevice, sizeof(nDevice));
 
 	state->pipe.wait_for_return();
@@ -1037,6 +1170,12 @@ MSABI vr::PropertyContainerHandle_t VRProperties::TrackedDeviceToPropertyContain
 
 	state->pipe.return_read_channel();
 
+	if(ret != vr::k_ulInvalidPropertyContainer) {
+		std::unique_lock lock(state->containersLock);
+		state->containers.insert(ret);
+	}
+
+	WINE_TRACE("ret %ld\n", ret);
 	return ret;
 }
 
@@ -1057,7 +1196,7 @@ MSABI void VRDriverLog::Log(const char *pchLogMessage) {
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_LOG);
-	state->pipe.send(&objId, sizeof(objId));
+	state->pipe.send_handle(objId);
 
 	uint64_t len = strlen(pchLogMessage);
 	state->pipe.send(&len, sizeof(len));
@@ -1117,7 +1256,7 @@ MSABI uint32_t VRResources::LoadSharedResource(const char *pchResourceName, char
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_RES_LOAD);
-	state->pipe.send(&objId, sizeof(size_t));
+	state->pipe.send_handle(objId);
 	uint64_t len = strlen(pchResourceName);
 	state->pipe.send(&len, sizeof(uint64_t));
 	state->pipe.send(pchResourceName, len);
@@ -1138,7 +1277,7 @@ MSABI uint32_t VRResources::GetResourceFullPath(const char *pchResourceName, con
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_RES_PATH);
-	state->pipe.send(&this->objId, sizeof(uint64_t));
+	state->pipe.send_handle(this->objId);
 	uint64_t nameLen = strlen(pchResourceName);
 	state->pipe.send(&nameLen, sizeof(uint64_t));
 	state->pipe.send(pchResourceName, nameLen);
@@ -1183,7 +1322,7 @@ MSABI void *VRServerConnector::GetGenericInterface( const char *pchInterfaceVers
 	ZoneScoped;
 
 	state->pipe.begin_call(METH_GET_INTERFACE);
-	state->pipe.send(&objId, sizeof(size_t));
+	state->pipe.send_handle(objId);
 	uint64_t len = strlen(pchInterfaceVersion);
 	state->pipe.send(&len, sizeof(uint64_t));
 	state->pipe.send(pchInterfaceVersion, len);
@@ -1191,7 +1330,7 @@ MSABI void *VRServerConnector::GetGenericInterface( const char *pchInterfaceVers
 	state->pipe.wait_for_return();
 
 	uint64_t objId;
-	state->pipe.recv(&objId, sizeof(uint64_t));
+	objId = state->pipe.recv_handle();
 	{
 		vr::EVRInitError err;
 		state->pipe.recv(&err, sizeof(vr::EVRInitError));
@@ -1255,6 +1394,47 @@ vr::DriverHandle_t VRServerConnector::GetDriverHandle() {
 	return 0x42424242;
 }
 
+struct FrameNext {
+	vr::SharedTextureHandle_t tex[2];
+	uint32_t indices[2];
+};
+
+struct FrameLayer {
+	vr::IVRDriverDirectModeComponent::SubmitLayerPerEye_t perEye[2];
+};
+
+static void destroy_swap_sets(struct DriverState *state, vr::IVRDriverDirectModeComponent *direct, vr::SharedTextureHandle_t *handles, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++) {
+		WINE_TRACE("Destroying set 0x%08lX\n", (uint64_t)handles[i]);
+		direct->DestroySwapTextureSet(handles[i]);
+		forget_swap_set(state, handles[i]);
+	}
+}
+
+static void destroy_all_swap_sets(struct DriverState *state, vr::IVRDriverDirectModeComponent *direct, uint32_t *pids, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++) {
+		WINE_TRACE("Destroying all sets of %d\n", pids[i]);
+		direct->DestroyAllSwapTextureSets(pids[i]);
+		forget_swap_sets_of(state, pids[i]);
+	}
+}
+
+static void publish_frame_timing(struct DriverState *state, vr::IVRDriverDirectModeComponent *direct) {
+	FrameTimingSlot *slot;
+	{
+		std::unique_lock lock(state->timingLock);
+		auto it = state->timing.find(direct);
+		if(it == state->timing.end()) return;
+		slot = it->second;
+	}
+
+	static_assert(sizeof(vr::DriverDirectMode_FrameTiming) <= sizeof(FrameTimingSlot::data));
+	vr::DriverDirectMode_FrameTiming frameTime = {0};
+	frameTime.m_nSize = sizeof(frameTime);
+	direct->GetFrameTiming(&frameTime);
+	slot->publish(&frameTime, sizeof(frameTime));
+}
+
 static void cmd_handler(enum PipeMethod m, void *state_) {
 	struct DriverState *state = (struct DriverState*)state_;
 	switch(m) {
@@ -1283,7 +1463,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 		}
 
 		state->pipe.return_from_call(taskId);
-		state->pipe.send(&nextId, sizeof(uint64_t));
+		state->pipe.send_handle(nextId);
 		state->pipe.send(&rc, sizeof(int));
 
 		free(buf);
@@ -1292,12 +1472,12 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 	case METH_DRIVER_INIT: {
 		ZoneScopedN("DRIVER_INIT");
 		size_t objId;
-		state->pipe.recv(&objId, sizeof(size_t));
+		objId = state->pipe.recv_handle();
 		assert(objId != 0);
 		vr::IServerTrackedDeviceProvider *driver = (vr::IServerTrackedDeviceProvider*)state->pipe.objs[objId-1];
 
 		uint64_t contextObjId;
-		state->pipe.recv(&contextObjId, sizeof(size_t));
+		contextObjId = state->pipe.recv_handle();
 		size_t taskId = state->pipe.complete_reading_args();
 
 		VRServerConnector *connector = new VRServerConnector(state, contextObjId);
@@ -1312,7 +1492,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 	case METH_DEV_ACTIVATE: {
 		ZoneScopedN("DEV_ACTIVATE");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::ITrackedDeviceServerDriver *thisObj = (vr::ITrackedDeviceServerDriver*)state->pipe.objs[thisHandle-1];
 
@@ -1326,10 +1506,24 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 		state->pipe.send(&ret, sizeof(ret));
 		break;
 	}
+	case METH_DEV_DEACTIVATE: {
+		ZoneScopedN("DEV_DEACTIVATE");
+		size_t thisHandle;
+		thisHandle = state->pipe.recv_handle();
+		assert(thisHandle != 0);
+		vr::ITrackedDeviceServerDriver *thisObj = (vr::ITrackedDeviceServerDriver*)state->pipe.objs[thisHandle-1];
+
+		size_t taskId = state->pipe.complete_reading_args();
+
+		thisObj->Deactivate();
+
+		state->pipe.return_from_call(taskId);
+		break;
+	}
 	case METH_DEV_COMPONENT: {
 		ZoneScopedN("DEV_COMPONENT");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(thisHandle));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::ITrackedDeviceServerDriver *thisObj = (vr::ITrackedDeviceServerDriver*)state->pipe.objs[thisHandle-1];
 
@@ -1352,7 +1546,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 	case METH_COMP_WINSIZE: {
 		ZoneScopedN("COMP_WINSIZE");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDisplayComponent *thisObj = (vr::IVRDisplayComponent*)state->pipe.objs[thisHandle-1];
 
@@ -1374,7 +1568,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 	case METH_COMP_DISTORTION: {
 		ZoneScopedN("COMP_DISTORTION");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDisplayComponent *thisObj = (vr::IVRDisplayComponent*)state->pipe.objs[thisHandle-1];
 
@@ -1396,7 +1590,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 	case METH_COMP_EYEVIEWPORT: {
 		ZoneScopedN("COMP_EYEVIEWPORT");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDisplayComponent *thisObj = (vr::IVRDisplayComponent*)state->pipe.objs[thisHandle-1];
 
@@ -1420,7 +1614,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 	case METH_COMP_ONDESKTOP: {
 		ZoneScopedN("COMP_ONDESKTOP");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDisplayComponent *thisObj = (vr::IVRDisplayComponent*)state->pipe.objs[thisHandle-1];
 
@@ -1435,7 +1629,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 	case METH_COMP_REALDISPLAY: {
 		ZoneScopedN("COMP_REALDISPLAY");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDisplayComponent *thisObj = (vr::IVRDisplayComponent*)state->pipe.objs[thisHandle-1];
 
@@ -1450,7 +1644,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 	case METH_COMP_PROJRAW: {
 		ZoneScopedN("COMP_PROJRAW");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDisplayComponent *thisObj = (vr::IVRDisplayComponent*)state->pipe.objs[thisHandle-1];
 
@@ -1474,7 +1668,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 	case METH_COMP_TARGETSIZE: {
 		ZoneScopedN("COMP_TARGETSIZE");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDisplayComponent *thisObj = (vr::IVRDisplayComponent*)state->pipe.objs[thisHandle-1];
 
@@ -1493,7 +1687,7 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 		ZoneScopedN("DIRECT_CSWAP");
 		WINE_TRACE("CSWAP\n");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDriverDirectModeComponent *thisObj = (vr::IVRDriverDirectModeComponent*)state->pipe.objs[thisHandle-1];
 
@@ -1502,6 +1696,11 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 		vr::IVRDriverDirectModeComponent::SwapTextureSetDesc_t textureDesc;
 		state->pipe.recv(&textureDesc, sizeof(textureDesc));
 		WINE_TRACE("%d %d %d %d\n", textureDesc.nWidth, textureDesc.nHeight, textureDesc.nFormat, textureDesc.nSampleCount);
+		// What the native side can import, best first
+		uint32_t modifierCount;
+		state->pipe.recv(&modifierCount, sizeof(modifierCount));
+		uint64_t *modifiers = (uint64_t*)malloc(modifierCount * sizeof(uint64_t));
+		state->pipe.recv(modifiers, modifierCount * sizeof(uint64_t));
 
 		size_t taskId = state->pipe.complete_reading_args();
 
@@ -1509,38 +1708,60 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 		thisObj->CreateSwapTextureSet(pid, &textureDesc, &texture);
 
 		WINE_TRACE("Converting HANDLEs to fds\n");
-		int linuxHandles[3];
-		uint32_t pitches[3];
-		for(uint8_t i = 0; i < 3; i++) {
-			HANDLE handle = (HANDLE)texture.rSharedTextureHandles[i];
+		struct SharedResource resources[3];
+		bool accepted = get_swap_set_resources(state, pid, texture.rSharedTextureHandles, resources);
+		if(!accepted) {
+			WINE_ERR("Failed to export set 0x%08lX\n", (uint64_t)texture.rSharedTextureHandles[0]);
+		}
+		for(uint8_t i = 0; i < 3 && accepted; i++) {
+			if(resources[i].metadata.PlaneCount > 4) {
+				WINE_ERR("dxvk allocated %d planes, the native side takes at most 4\n", resources[i].metadata.PlaneCount);
+				accepted = false;
+				continue;
+			}
+			bool importable = false;
+			for(uint32_t j = 0; j < modifierCount; j++) {
+				importable |= modifiers[j] == resources[i].metadata.DRMFormat;
+			}
+			if(!importable) {
+				WINE_ERR("dxvk allocated modifier %lx which the native side can't import\n", resources[i].metadata.DRMFormat);
+				accepted = false;
+			}
+		}
 
-			int fd;
-			fd = get_shared_resource_fd(handle, state, &pitches[i]);
-			WINE_TRACE("    0x%08lX -> 0x%08X\n", (uint64_t)handle, fd);
-			/* wine_server_handle_to_fd(handle, FILE_READ_DATA, &fd, NULL); */
-			linuxHandles[i] = fd;
+		if(!accepted) {
+			thisObj->DestroySwapTextureSet(texture.rSharedTextureHandles[0]);
+			forget_swap_set(state, texture.rSharedTextureHandles[0]);
 		}
 
 		state->pipe.return_from_call(taskId);
-		state->pipe.send(&texture.unTextureFlags, sizeof(texture.unTextureFlags));
-		WINE_TRACE("Sending fds\n");
-		state->pipe.send_fd(linuxHandles[0]);
-		state->pipe.send_fd(linuxHandles[1]);
-		state->pipe.send_fd(linuxHandles[2]);
-		// Send some numbers that it can use to refer to the textures
-		// By using the handles we'd have to use we avoid having to translate anything
-		state->pipe.send(&texture.rSharedTextureHandles[0], sizeof(texture.rSharedTextureHandles[0]));
-		state->pipe.send(&texture.rSharedTextureHandles[1], sizeof(texture.rSharedTextureHandles[1]));
-		state->pipe.send(&texture.rSharedTextureHandles[2], sizeof(texture.rSharedTextureHandles[2]));
-		state->pipe.send(&pitches[0], sizeof(pitches[0]));
-		state->pipe.send(&pitches[1], sizeof(pitches[1]));
-		state->pipe.send(&pitches[2], sizeof(pitches[2]));
+		state->pipe.send(&accepted, sizeof(accepted));
+		if(accepted) {
+			state->pipe.send(&texture.unTextureFlags, sizeof(texture.unTextureFlags));
+			WINE_TRACE("Sending fds\n");
+			for(uint8_t i = 0; i < 3; i++) {
+				state->pipe.send_fd(resources[i].fd);
+				// Send some numbers that it can use to refer to the textures
+				// By using the handles we'd have to use we avoid having to translate anything
+				state->pipe.send(&texture.rSharedTextureHandles[i], sizeof(texture.rSharedTextureHandles[i]));
+				state->pipe.send(&resources[i].metadata.DRMFormat, sizeof(resources[i].metadata.DRMFormat));
+				const DxvkSharedTextureMetadata *metadata = &resources[i].metadata;
+				uint32_t planeCount = metadata->PlaneCount;
+				state->pipe.send(&planeCount, sizeof(planeCount));
+				for(uint32_t j = 0; j < planeCount; j++) {
+					state->pipe.send(&metadata->PlaneOffsets[j], sizeof(metadata->PlaneOffsets[j]));
+					state->pipe.send(&metadata->PlaneStrides[j], sizeof(metadata->PlaneStrides[j]));
+				}
+			}
+		}
+
+		free(modifiers);
 		break;
 	}
 	case METH_DIRECT_NEXT: {
 		ZoneScopedN("DIRECT_NEXT");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDriverDirectModeComponent *thisObj = (vr::IVRDriverDirectModeComponent*)state->pipe.objs[thisHandle-1];
 
@@ -1560,86 +1781,202 @@ static void cmd_handler(enum PipeMethod m, void *state_) {
 		state->pipe.send(indecies, sizeof(indecies));
 		break;
 	}
-	case METH_DIRECT_SUBMIT: {
-		ZoneScopedN("DIRECT_SUBMIT");
+	case METH_DIRECT_FRAME: {
+		ZoneScopedN("DIRECT_FRAME");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDriverDirectModeComponent *thisObj = (vr::IVRDriverDirectModeComponent*)state->pipe.objs[thisHandle-1];
 
-		vr::IVRDriverDirectModeComponent::SubmitLayerPerEye_t perEye[2];
-		for(uint8_t i = 0; i < 2; i++) {
-			state->pipe.recv(&perEye[i].hTexture, sizeof(perEye[i].hTexture));
-			state->pipe.recv(&perEye[i].hDepthTexture, sizeof(perEye[i].hDepthTexture));
-			state->pipe.recv(&perEye[i].bounds, sizeof(perEye[i].bounds));
-			state->pipe.recv(&perEye[i].mProjection, sizeof(perEye[i].mProjection));
-			state->pipe.recv(&perEye[i].mHmdPose, sizeof(perEye[i].mHmdPose));
-			state->pipe.recv(&perEye[i].flHmdPosePredictionTimeInSecondsFromNow, sizeof(perEye[i].flHmdPosePredictionTimeInSecondsFromNow));
+		uint64_t frameNumber;
+		state->pipe.recv(&frameNumber, sizeof(frameNumber));
+#ifdef TRACY_ENABLE
+		char frameText[32];
+		ZoneText(frameText, snprintf(frameText, sizeof(frameText), "frame %lu", frameNumber));
+#endif
+
+		uint32_t nextCount;
+		state->pipe.recv(&nextCount, sizeof(nextCount));
+		struct FrameNext *nexts = (struct FrameNext*)malloc(nextCount * sizeof(struct FrameNext));
+		for(uint32_t i = 0; i < nextCount; i++) {
+			state->pipe.recv(&nexts[i].tex[0], sizeof(nexts[i].tex[0]));
+			state->pipe.recv(&nexts[i].tex[1], sizeof(nexts[i].tex[1]));
+			state->pipe.recv(nexts[i].indices, sizeof(nexts[i].indices));
+		}
+
+		uint32_t layerCount;
+		state->pipe.recv(&layerCount, sizeof(layerCount));
+		struct FrameLayer *layers = (struct FrameLayer*)malloc(layerCount * sizeof(struct FrameLayer));
+		for(uint32_t j = 0; j < layerCount; j++) {
+			vr::IVRDriverDirectModeComponent::SubmitLayerPerEye_t *perEye = layers[j].perEye;
+			for(uint8_t i = 0; i < 2; i++) {
+				state->pipe.recv(&perEye[i].hTexture, sizeof(perEye[i].hTexture));
+				state->pipe.recv(&perEye[i].hDepthTexture, sizeof(perEye[i].hDepthTexture));
+				state->pipe.recv(&perEye[i].bounds, sizeof(perEye[i].bounds));
+				state->pipe.recv(&perEye[i].mProjection, sizeof(perEye[i].mProjection));
+				state->pipe.recv(&perEye[i].mHmdPose, sizeof(perEye[i].mHmdPose));
+				state->pipe.recv(&perEye[i].flHmdPosePredictionTimeInSecondsFromNow, sizeof(perEye[i].flHmdPosePredictionTimeInSecondsFromNow));
+			}
 		}
 
+		vr::SharedTextureHandle_t sync;
+		state->pipe.recv(&sync, sizeof(sync));
+		uint32_t fenceCount;
+		state->pipe.recv(&fenceCount, sizeof(fenceCount));
+		int *fences = (int*)malloc(fenceCount * sizeof(int));
+		for(uint32_t i = 0; i < fenceCount; i++) {
+			state->pipe.recv_fd(&fences[i]);
+		}
+		uint32_t fenceWaitMs;
+		state->pipe.recv(&fenceWaitMs, sizeof(fenceWaitMs));
+		vr::IVRDriverDirectModeComponent::Throttling_t throttle;
+		state->pipe.recv(&throttle, sizeof(throttle));
+
+		uint32_t destroyCount;
+		state->pipe.recv(&destroyCount, sizeof(destroyCount));
+		vr::SharedTextureHandle_t *destroyed = (vr::SharedTextureHandle_t*)malloc(destroyCount * sizeof(vr::SharedTextureHandle_t));
+		state->pipe.recv(destroyed, destroyCount * sizeof(vr::SharedTextureHandle_t));
+		uint32_t destroyPidCount;
+		state->pipe.recv(&destroyPidCount, sizeof(destroyPidCount));
+		uint32_t *destroyedPids = (uint32_t*)malloc(destroyPidCount * sizeof(uint32_t));
+		state->pipe.recv(destroyedPids, destroyPidCount * sizeof(uint32_t));
+
 		size_t taskId = state->pipe.complete_reading_args();
 
-		vr::IVRDriverDirectModeComponent::SwapTextureSet_t texture;
-		thisObj->SubmitLayer(perEye);
+		// The native side guessed these indices, make sure the driver agrees
+		bool inStep = true;
+		for(uint32_t i = 0; i < nextCount; i++) {
+			uint32_t indices[2] = {0};
+			thisObj->GetNextSwapTextureSetIndex(nexts[i].tex, &indices);
+			for(uint8_t j = 0; j < 2; j++) {
+				if(nexts[i].tex[j] != 0 && indices[j] != nexts[i].indices[j]) {
+					WINE_ERR("Predicted index %d for 0x%08lX, driver says %d\n", nexts[i].indices[j], (uint64_t)nexts[i].tex[j], indices[j]);
+					inStep = false;
+				}
+			}
+		}
+
+		// Don't let the driver near the textures before vrserver is done with
+		// them. We can't hand a sync_file to the driver or import it through
+		// dxvk, so this is a CPU wait, but never longer than a frame.
+		if(fenceCount > 0) {
+			ZoneScopedN("FenceWait");
+			auto start = std::chrono::steady_clock::now();
+			if(!fence_wait_all(fences, fenceCount, fenceWaitMs)) {
+				uint64_t timeouts = ++state->fenceTimeouts;
+				WINE_ERR("Frame fences didn't signal in %ums, presenting anyway (%lu times)\n", fenceWaitMs, timeouts);
+				TracyPlot("Fence timeouts", (int64_t)timeouts);
+			}
+			for(uint32_t i = 0; i < fenceCount; i++) {
+				close(fences[i]);
+			}
+			TracyPlot("Fence wait (us)", (int64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+		}
+
+		{
+			ZoneScopedN("SubmitLayer");
+			for(uint32_t i = 0; i < layerCount; i++) {
+				thisObj->SubmitLayer(layers[i].perEye);
+			}
+		}
+		{
+			ZoneScopedN("Present");
+			thisObj->Present(sync);
+		}
+		{
+			ZoneScopedN("PostPresent");
+			thisObj->PostPresent(&throttle);
+		}
+		publish_frame_timing(state, thisObj);
+
+		destroy_swap_sets(state, thisObj, destroyed, destroyCount);
+		destroy_all_swap_sets(state, thisObj, destroyedPids, destroyPidCount);
 
 		state->pipe.return_from_call(taskId);
+		state->pipe.send(&inStep, sizeof(inStep));
+		FrameMark;
+
+		free(nexts);
+		free(layers);
+		free(fences);
+		free(destroyed);
+		free(destroyedPids);
 		break;
 	}
-	case METH_DIRECT_PRESENT: {
-		ZoneScopedN("DIRECT_PRESENT");
+	case METH_DIRECT_FTIMESLOT: {
+		ZoneScopedN("DIRECT_FTIMESLOT");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDriverDirectModeComponent *thisObj = (vr::IVRDriverDirectModeComponent*)state->pipe.objs[thisHandle-1];
 
-		vr::SharedTextureHandle_t tex;
-		state->pipe.recv(&tex, sizeof(tex));
+		int fd;
+		state->pipe.recv_fd(&fd);
 
 		size_t taskId = state->pipe.complete_reading_args();
 
-		thisObj->Present(tex);
+		FrameTimingSlot *slot = (FrameTimingSlot*)shm_map(fd, sizeof(FrameTimingSlot));
+		close(fd);
+		if(slot == nullptr) {
+			WINE_ERR("Failed to map the frame timing slot\n");
+			abort();
+		}
+		{
+			std::unique_lock lock(state->timingLock);
+			state->timing[thisObj] = slot;
+		}
+		// Make sure there's always something to read
+		publish_frame_timing(state, thisObj);
 
 		state->pipe.return_from_call(taskId);
-		FrameMark;
 		break;
 	}
-	case METH_DIRECT_POSTPRES: {
-		ZoneScopedN("DIRECT_POSTPRES");
+	case METH_DIRECT_DSWAP: {
+		ZoneScopedN("DIRECT_DSWAP");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDriverDirectModeComponent *thisObj = (vr::IVRDriverDirectModeComponent*)state->pipe.objs[thisHandle-1];
 
-		vr::IVRDriverDirectModeComponent::Throttling_t throttle;
-		state->pipe.recv(&throttle, sizeof(throttle));
+		uint32_t count;
+		state->pipe.recv(&count, sizeof(count));
+		vr::SharedTextureHandle_t *handles = (vr::SharedTextureHandle_t*)malloc(count * sizeof(vr::SharedTextureHandle_t));
+		state->pipe.recv(handles, count * sizeof(vr::SharedTextureHandle_t));
 
 		size_t taskId = state->pipe.complete_reading_args();
 
-		thisObj->PostPresent(&throttle);
+		destroy_swap_sets(state, thisObj, handles, count);
 
 		state->pipe.return_from_call(taskId);
+
+		free(handles);
 		break;
 	}
-	case METH_DIRECT_FTIME: {
-		ZoneScopedN("DIRECT_FTIME");
+	case METH_DIRECT_DSWAPALL: {
+		ZoneScopedN("DIRECT_DSWAPALL");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IVRDriverDirectModeComponent *thisObj = (vr::IVRDriverDirectModeComponent*)state->pipe.objs[thisHandle-1];
 
+		uint32_t count;
+		state->pipe.recv(&count, sizeof(count));
+		uint32_t *pids = (uint32_t*)malloc(count * sizeof(uint32_t));
+		state->pipe.recv(pids, count * sizeof(uint32_t));
+
 		size_t taskId = state->pipe.complete_reading_args();
 
-		vr::DriverDirectMode_FrameTiming frameTime;
-		thisObj->GetFrameTiming(&frameTime);
+		destroy_all_swap_sets(state, thisObj, pids, count);
 
 		state->pipe.return_from_call(taskId);
-		state->pipe.send(&frameTime, sizeof(frameTime));
+
+		free(pids);
 		break;
 	}
 	case METH_DRIVER_RUNFRAME: {
 		ZoneScopedN("DRIVER_RUNFRAME");
 		size_t thisHandle;
-		state->pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = state->pipe.recv_handle();
 		assert(thisHandle != 0);
 		vr::IServerTrackedDeviceProvider *thisObj = (vr::IServerTrackedDeviceProvider*)state->pipe.objs[thisHandle-1];
 
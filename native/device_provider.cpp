@@ -15,7 +15,7 @@ vr::EVRInitError DeviceProvider::Init(vr::IVRDriverContext* pDriverContext) {
 
 	global_pipe.msg("Sent init call %d\n", method);
 
-	global_pipe.send(&this->handle, sizeof(size_t));
+	global_pipe.send_handle(this->handle);
 
 	global_pipe.send_new_obj(pDriverContext);
 
@@ -43,7 +43,7 @@ void DeviceProvider::RunFrame() {
 	global_pipe.msg("Call RunFrame()\n");
     vr::VREvent_t vrevent;
 	global_pipe.begin_call(METH_DRIVER_RUNFRAME);
-	global_pipe.send(&this->handle, sizeof(uint64_t));
+	global_pipe.send_handle(this->handle);
 	global_pipe.wait_for_return();
 	global_pipe.return_read_channel();
 }
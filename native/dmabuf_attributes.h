@@ -1,3 +1,5 @@
+#pragma once
+
 #include <cstdint>
 
 #pragma pack(push, 8)
@@ -0,0 +1,92 @@
+#include "dmabuf_format.h"
+
+#include <algorithm>
+#include <libdrm/drm_fourcc.h>
+#include <unistd.h>
+
+// The sRGB variants share a fourcc with their UNORM siblings, DRM doesn't
+// care about the transfer function.
+static const struct SwapFormat formats[] = {
+	// VK_FORMAT_R8G8B8A8_UNORM -> DXGI_FORMAT_R8G8B8A8_UNORM
+	{ 37, 28, DRM_FORMAT_ABGR8888, 4 },
+	// VK_FORMAT_R8G8B8A8_SRGB -> DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+	{ 43, 29, DRM_FORMAT_ABGR8888, 4 },
+	// VK_FORMAT_B8G8R8A8_UNORM -> DXGI_FORMAT_B8G8R8A8_UNORM
+	{ 44, 87, DRM_FORMAT_ARGB8888, 4 },
+	// VK_FORMAT_B8G8R8A8_SRGB -> DXGI_FORMAT_B8G8R8A8_UNORM_SRGB
+	{ 50, 91, DRM_FORMAT_ARGB8888, 4 },
+	// VK_FORMAT_A2B10G10R10_UNORM_PACK32 -> DXGI_FORMAT_R10G10B10A2_UNORM
+	{ 64, 24, DRM_FORMAT_ABGR2101010, 4 },
+	// VK_FORMAT_R16G16B16A16_SFLOAT -> DXGI_FORMAT_R16G16B16A16_FLOAT
+	{ 97, 10, DRM_FORMAT_ABGR16161616F, 8 },
+};
+
+const struct SwapFormat *swap_format_from_vk(uint32_t vkFormat) {
+	for(const struct SwapFormat &format : formats) {
+		if(format.vkFormat == vkFormat) return &format;
+	}
+	return nullptr;
+}
+
+bool negotiate_modifiers(IVRIPCResourceManagerClient2 *resMan, uint32_t drmFormat, std::vector<uint64_t> *modifiers) {
+	modifiers->clear();
+
+	uint32_t formatCount = 0;
+	if(!resMan->GetDmabufFormats(&formatCount, nullptr)) return false;
+	std::vector<uint32_t> drmFormats(formatCount);
+	if(!resMan->GetDmabufFormats(&formatCount, drmFormats.data())) return false;
+	drmFormats.resize(formatCount);
+
+	if(std::find(drmFormats.begin(), drmFormats.end(), drmFormat) == drmFormats.end()) return false;
+
+	uint32_t modifierCount = 0;
+	if(!resMan->GetDmabufModifiers(vr::VRApplication_Other, drmFormat, &modifierCount, nullptr)) return false;
+	modifiers->resize(modifierCount);
+	if(!resMan->GetDmabufModifiers(vr::VRApplication_Other, drmFormat, &modifierCount, modifiers->data())) return false;
+	modifiers->resize(modifierCount);
+
+	// Keep vrserver's order, except linear goes last. It's always the slowest
+	// layout to sample from and to encode.
+	modifiers->erase(std::remove(modifiers->begin(), modifiers->end(), DRM_FORMAT_MOD_INVALID), modifiers->end());
+	std::stable_partition(modifiers->begin(), modifiers->end(), [](uint64_t mod) { return mod != DRM_FORMAT_MOD_LINEAR; });
+
+	return !modifiers->empty();
+}
+
+bool dmabuf_attributes(const struct SwapFormat *format, uint32_t width, uint32_t height, uint64_t modifier, uint32_t planeCount, const struct DmabufPlane_t *planes, struct DmabufAttributes_t *dma) {
+	if(modifier == DRM_FORMAT_MOD_INVALID) return false;
+	if(planeCount == 0 || planeCount > MaxDmabufPlaneCount) return false;
+	// Linear has nowhere to put auxiliary planes
+	if(modifier == DRM_FORMAT_MOD_LINEAR && planeCount != 1) return false;
+
+	*dma = {
+		.pNext = nullptr,
+		.unWidth = width,
+		.unHeight = height,
+		.unDepth = 1,
+		.unMipLevels = 1,
+		.unArrayLayers = 1,
+		.unSampleCount = 1,
+		.unFormat = format->drmFormat,
+		.ulModifier = modifier,
+		.unPlaneCount = planeCount,
+		.plane = {},
+	};
+	for(uint32_t i = 0; i < planeCount; i++) {
+		if(planes[i].nFd < 0 || planes[i].unStride == 0) return false;
+
+		// Tiled layouts pad in ways we don't know, but every plane has to
+		// start inside the buffer, and a linear one has to fit
+		off_t size = lseek(planes[i].nFd, 0, SEEK_END);
+		if(size > 0) {
+			if(planes[i].unOffset >= size) return false;
+			if(modifier == DRM_FORMAT_MOD_LINEAR) {
+				if(planes[i].unStride < (uint64_t)width * format->bytesPerPixel) return false;
+				if(planes[i].unOffset + (uint64_t)planes[i].unStride * height > (uint64_t)size) return false;
+			}
+		}
+
+		dma->plane[i] = planes[i];
+	}
+	return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "resource_manager.h"
+
+// vrserver asks for swap sets in VkFormat, the Windows driver wants DXGI and
+// the import wants a DRM fourcc.
+struct SwapFormat {
+	uint32_t vkFormat;
+	uint32_t dxgiFormat;
+	uint32_t drmFormat;
+	uint32_t bytesPerPixel;
+};
+
+// nullptr if we don't know how to share the format
+const struct SwapFormat *swap_format_from_vk(uint32_t vkFormat);
+
+// Collects the modifiers vrserver can import for the format, best first.
+// Returns false if it can't import the format at all.
+bool negotiate_modifiers(IVRIPCResourceManagerClient2 *resMan, uint32_t drmFormat, std::vector<uint64_t> *modifiers);
+
+// Fills in the import for one texture. Fails if the planes can't describe
+// the texture, rather than leaving vrserver to find out.
+bool dmabuf_attributes(const struct SwapFormat *format, uint32_t width, uint32_t height, uint64_t modifier, uint32_t planeCount, const struct DmabufPlane_t *planes, struct DmabufAttributes_t *dma);
@@ -1,14 +1,21 @@
 #include "device_provider.h"
 #include "ipc.h"
+#include "shm.h"
+#include "fence.h"
+#include "tracy/Tracy.hpp"
 
 #include "openvr_driver.h"
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <cstdio>
 #include <libdrm/drm_fourcc.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include "dmabuf_attributes.h"
+#include "dmabuf_format.h"
+#include "resource_manager.h"
 
 using namespace vr;
 
@@ -86,21 +93,120 @@ class VRDriverDirect : IVRDriverDirectModeComponent
 {
 	uint64_t objId;
 
-	uint8_t refs = 0;
+	struct SwapSet {
+		uint32_t owner;
+		vr::SharedTextureHandle_t ours[3];
+		vr::SharedTextureHandle_t theirs[3];
+		// Kept so we can export fences from them
+		int fds[3];
+		// The index we last handed out for this set, -1 until the Windows
+		// driver has told us once.
+		int8_t current;
+		// Set once two real calls in a row showed the driver rotating the
+		// set like we would. We don't predict before that.
+		bool rotates;
+	};
 
-	// @PERF: This should be a real datastructure. Back when it was a couple of
-	// textures, I could justify the argument that it was probably faster to
-	// probe an array, but this is a lot of textures.
-	uint32_t owner[3*80];
-	uint64_t ourRefs[3*80];
-	uint64_t theirRefs[3*80];
+	// @PERF: Still probed linearly, but at least it's per set now. There's
+	// rarely more than a handful of sets alive at once.
+	std::mutex setsLock;
+	std::vector<struct SwapSet> sets;
+
+	// Destruction is forwarded to the Windows driver in batches at the frame
+	// boundary. Nothing is waiting on the free, so there's no reason to stall
+	// whoever called us on a round trip.
+	std::mutex destroyLock;
+	std::vector<vr::SharedTextureHandle_t> pendingDestroy;
+	std::vector<uint32_t> pendingDestroyAll;
+
+	// Everything vrserver tells us during a frame is collected here and sent
+	// to the Windows driver in one message on Present.
+	struct NextCall {
+		vr::SharedTextureHandle_t theirs[2];
+		uint32_t indices[2];
+	};
+	struct FrameLayer {
+		SubmitLayerPerEye_t perEye[2];
+	};
+	std::mutex frameLock;
+	std::vector<struct NextCall> pendingNext;
+	std::vector<struct FrameLayer> layers;
+	Throttling_t throttling = {0};
+
+	// Published by the dllhost after every frame
+	FrameTimingSlot *timing;
+
+	// The swap sets rotate, so we answer GetNextSwapTextureSetIndex ourselves
+	// and have the Windows driver check our work when the frame goes out. If
+	// it ever disagrees we stop guessing.
+	std::atomic<bool> predictNext = true;
+	// Set when we stop guessing, the next real call sends what's left first
+	std::atomic<bool> replayNext = false;
+
+	struct Frame {
+		// Same as the frame number the pipe tagged this frame's calls with
+		uint64_t number;
+		std::vector<struct NextCall> nexts;
+		std::vector<struct FrameLayer> layers;
+		vr::SharedTextureHandle_t sync;
+		// Signal when vrserver is done rendering the textures the frame
+		// uses, one per texture
+		std::vector<int> fences;
+		Throttling_t throttle;
+		std::vector<vr::SharedTextureHandle_t> destroyed;
+		std::vector<uint32_t> destroyedPids;
+
+		std::chrono::steady_clock::time_point queued;
+		std::chrono::steady_clock::duration interval;
+	};
+	std::chrono::steady_clock::time_point lastPresent;
+	// The Windows side never waits on a frame's fences for longer than the
+	// time between Presents, or this if that's longer. A 30Hz frame.
+	static constexpr uint32_t MaxFenceWaitMs = 34;
+
+	// In async mode Present just hands the frame to the sender thread. There's
+	// only ever one frame waiting, a newer one replaces it.
+	bool async = false;
+	std::thread sender;
+	bool senderStop = false;
+	std::mutex senderLock;
+	std::condition_variable senderCond;
+	bool framePending = false;
+	// The sender took a frame and is still sending it
+	bool frameSending = false;
+	struct Frame pendingFrame;
+	// Destruction outside a frame has to go out after the pending frame,
+	// which might still use the set, so the sender does that too. Real index
+	// calls wait on the same condition for the frame to be out.
+	std::condition_variable flushCond;
+	uint64_t flushRequests = 0;
+	uint64_t flushesDone = 0;
+
+	struct {
+		std::atomic<uint64_t> sent = 0;
+		std::atomic<uint64_t> dropped = 0;
+		std::atomic<uint64_t> late = 0;
+		std::chrono::steady_clock::time_point lastReport;
+	} stats;
 
 	bool TranslateToTheirs(vr::SharedTextureHandle_t ours, vr::SharedTextureHandle_t *theirs);
-	void MapTextures(vr::SharedTextureHandle_t **ours, vr::SharedTextureHandle_t **theirs, uint32_t **pids);
-	bool FindFromOurs(vr::SharedTextureHandle_t needle, size_t *i);
-	bool FindFromOwner(uint32_t needle, size_t *index);
+	bool FindFromOurs(vr::SharedTextureHandle_t needle, size_t *set);
+	void ExportFences(vr::SharedTextureHandle_t sync, const std::vector<struct FrameLayer> &layers, std::vector<int> *fences);
+	bool PredictNext(vr::SharedTextureHandle_t handles[2], uint32_t (*indices)[2]);
+	void LearnNext(vr::SharedTextureHandle_t handles[2], uint32_t (*indices)[2]);
+	void SendNext(const vr::SharedTextureHandle_t theirs[2], uint32_t (*indices)[2]);
+	void ReplayNext();
+	void TakeDestroyed(std::vector<vr::SharedTextureHandle_t> *handles, std::vector<uint32_t> *pids);
+	void FlushDestroyed();
+	void WaitForSender();
+	void SendDestroyed();
+	void SendFrame(struct Frame *frame);
+	void QueueFrame(struct Frame *frame);
+	static void SenderThread(VRDriverDirect *self);
+	void ReportStats();
 public:
-	VRDriverDirect(uint64_t objId) : objId(objId) {};
+	VRDriverDirect(uint64_t objId);
+	~VRDriverDirect();
 
 	virtual void CreateSwapTextureSet( uint32_t unPid, const SwapTextureSetDesc_t *pSwapTextureSetDesc, SwapTextureSet_t *pOutSwapTextureSet );
 	virtual void DestroySwapTextureSet( vr::SharedTextureHandle_t sharedTextureHandle );
@@ -112,281 +218,680 @@ public:
 	virtual void GetFrameTiming( DriverDirectMode_FrameTiming *pFrameTiming );
 };
 
-class IVRIPCResourceManagerClient2 {
-public:
-	virtual bool NewSharedVulkanImage( uint32_t nImageFormat, uint32_t nWidth, uint32_t nHeight, bool bRenderable, bool bMappable, bool bComputeAccess, uint32_t unMipLevels, uint32_t unArrayLayerCount, vr::SharedTextureHandle_t *pSharedHandle ) = 0;
-	virtual bool NewSharedVulkanBuffer( uint32_t nSize, uint32_t nUsageFlags, vr::SharedTextureHandle_t *pSharedHandle ) = 0;
-	virtual bool NewSharedVulkanSemaphore( vr::SharedTextureHandle_t *pSharedHandle ) = 0;
-	virtual bool RefResource( vr::SharedTextureHandle_t hSharedHandle, uint64_t *pNewIpcHandle ) = 0;
-	virtual bool UnrefResource( vr::SharedTextureHandle_t hSharedHandle ) = 0;
-	virtual bool GetDmabufFormats( uint32_t *pOutFormatCount, uint32_t *pOutFormats ) = 0;
-	virtual bool GetDmabufModifiers( vr::EVRApplicationType eApplicationType, uint32_t unDRMFormat, uint32_t *pOutModifierCount, uint64_t *pOutModifiers ) = 0;
-	virtual bool ImportDmabuf( vr::EVRApplicationType eApplicationType, DmabufAttributes_t *pDmabufAttributes, vr::SharedTextureHandle_t *pSharedHandle ) = 0;
-	virtual bool ReceiveSharedFd( uint64_t ulIpcHandle, int *pOutFd ) = 0;
-};
+VRDriverDirect::VRDriverDirect(uint64_t objId) : objId(objId) {
+	vr::EVRSettingsError err;
+	async = vr::VRSettings()->GetBool("driver_vrdriver", "async_present", &err);
+	if(err != vr::VRSettingsError_None) {
+		async = false;
+	}
+	global_pipe.msg("Async present %s\n", async ? "enabled" : "disabled");
+	if(async) {
+		sender = std::thread(SenderThread, this);
+	}
+
+	int fd;
+	timing = (FrameTimingSlot*)shm_create("vrlink-frametiming", sizeof(FrameTimingSlot), &fd);
+	if(timing == nullptr) {
+		global_pipe.msg("Failed to create the frame timing slot %d\n", errno);
+		abort();
+	}
+
+	global_pipe.begin_call(METH_DIRECT_FTIMESLOT);
+	global_pipe.send_handle(this->objId);
+	global_pipe.send_fd(fd);
+
+	global_pipe.wait_for_return();
+	global_pipe.return_read_channel();
+
+	close(fd);
+}
+VRDriverDirect::~VRDriverDirect() {
+	if(sender.joinable()) {
+		{
+			std::unique_lock lock(senderLock);
+			senderStop = true;
+		}
+		senderCond.notify_one();
+		flushCond.notify_all();
+		sender.join();
+	}
+	if(framePending) {
+		for(int fence : pendingFrame.fences) close(fence);
+	}
+}
 
 void VRDriverDirect::CreateSwapTextureSet( uint32_t unPid, const SwapTextureSetDesc_t *pSwapTextureSetDesc, SwapTextureSet_t *pOutSwapTextureSet ) {
+	ZoneScoped;
 	global_pipe.msg("call CreateSwapTextureSet(%d, %p, %p)\n", unPid, pSwapTextureSetDesc, pOutSwapTextureSet);
 	global_pipe.msg("%d %d %d %d\n", pSwapTextureSetDesc->nWidth, pSwapTextureSetDesc->nHeight, pSwapTextureSetDesc->nFormat, pSwapTextureSetDesc->nSampleCount);
+	*pOutSwapTextureSet = {0};
+
 	// I think this is in VkFormat even though the documentation states it's in DXGI_FORMAT
-	assert(pSwapTextureSetDesc->nFormat == 43);
+	const struct SwapFormat *format = swap_format_from_vk(pSwapTextureSetDesc->nFormat);
+	if(format == nullptr) {
+		global_pipe.msg("Don't know how to share VkFormat %d\n", pSwapTextureSetDesc->nFormat);
+		return;
+	}
+
+	IVRIPCResourceManagerClient2 *resMan = (IVRIPCResourceManagerClient2*)vr::VRIPCResourceManager();
+	assert(resMan != NULL);
+	std::vector<uint64_t> modifiers;
+	if(!negotiate_modifiers(resMan, format->drmFormat, &modifiers)) {
+		global_pipe.msg("vrserver can't import DRM format %08x\n", format->drmFormat);
+		return;
+	}
+	global_pipe.msg("vrserver takes %d modifiers, best is %016lx\n", modifiers.size(), modifiers[0]);
 
-	vr::SharedTextureHandle_t *ours;
-	vr::SharedTextureHandle_t *theirs;
-	uint32_t *pids;
-	MapTextures(&ours, &theirs, &pids);
+	// Let the Windows driver free whatever is queued before it allocates more
+	FlushDestroyed();
+
+	struct SwapSet set;
+	set.owner = unPid;
+	set.current = -1;
+	set.rotates = false;
+	vr::SharedTextureHandle_t *ours = set.ours;
+	vr::SharedTextureHandle_t *theirs = set.theirs;
 
 	global_pipe.begin_call(METH_DIRECT_CSWAP);
-	global_pipe.send(&this->objId, sizeof(uint64_t));
+	global_pipe.send_handle(this->objId);
 	global_pipe.send(&unPid, sizeof(unPid));
-	// VKFormat 43 translates to DXGI format 29
 	SwapTextureSetDesc_t requestedTexture = {
 		.nWidth = pSwapTextureSetDesc->nWidth,
 		.nHeight = pSwapTextureSetDesc->nHeight,
-		.nFormat = 29,
+		.nFormat = format->dxgiFormat,
 		.nSampleCount = pSwapTextureSetDesc->nSampleCount
 	};
 	global_pipe.send(&requestedTexture, sizeof(requestedTexture));
-
+	uint32_t modifierCount = modifiers.size();
+	global_pipe.send(&modifierCount, sizeof(modifierCount));
+	global_pipe.send(modifiers.data(), modifierCount * sizeof(modifiers[0]));
 
 	global_pipe.wait_for_return();
+	bool accepted;
+	global_pipe.recv(&accepted, sizeof(accepted));
+	if(!accepted) {
+		global_pipe.return_read_channel();
+		global_pipe.msg("The Windows side couldn't produce a set we can import\n");
+		return;
+	}
+
 	global_pipe.recv(&pOutSwapTextureSet->unTextureFlags, sizeof(pOutSwapTextureSet->unTextureFlags));
 	int fds[3];
-	global_pipe.recv_fd(&fds[0]);
-	global_pipe.recv_fd(&fds[1]);
-	global_pipe.recv_fd(&fds[2]);
+	uint64_t modifier[3];
+	uint32_t planeCount[3];
+	struct DmabufPlane_t planes[3][MaxDmabufPlaneCount];
+	for(uint8_t i = 0; i < 3; i++) {
+		global_pipe.recv_fd(&fds[i]);
+		global_pipe.recv(&theirs[i], sizeof(theirs[i]));
+		global_pipe.recv(&modifier[i], sizeof(modifier[i]));
+		global_pipe.recv(&planeCount[i], sizeof(planeCount[i]));
+		assert(planeCount[i] > 0 && planeCount[i] <= MaxDmabufPlaneCount);
+		for(uint32_t j = 0; j < planeCount[i]; j++) {
+			global_pipe.recv(&planes[i][j].unOffset, sizeof(planes[i][j].unOffset));
+			global_pipe.recv(&planes[i][j].unStride, sizeof(planes[i][j].unStride));
+			// All the planes live in the same allocation
+			planes[i][j].nFd = fds[i];
+		}
+	}
 	global_pipe.msg("Recv fds %d %d %d\n", fds[0], fds[1], fds[2]);
-	global_pipe.recv(&theirs[0], sizeof(theirs[0]));
-	global_pipe.recv(&theirs[1], sizeof(theirs[1]));
-	global_pipe.recv(&theirs[2], sizeof(theirs[2]));
-	uint32_t pitches[3];
-	global_pipe.recv(&pitches[0], sizeof(pitches[0]));
-	global_pipe.recv(&pitches[1], sizeof(pitches[1]));
-	global_pipe.recv(&pitches[2], sizeof(pitches[2]));
 	global_pipe.return_read_channel();
 
-	IVRIPCResourceManagerClient2 *resMan = (IVRIPCResourceManagerClient2*)vr::VRIPCResourceManager();
-	assert(resMan != NULL);
+	// Check all three before importing any, a bad layout is the Windows
+	// side's fault and shouldn't take vrserver down with it
+	struct DmabufAttributes_t dma[3];
+	for(uint8_t i = 0; i < 3; i++) {
+		if(!dmabuf_attributes(format, pSwapTextureSetDesc->nWidth, pSwapTextureSetDesc->nHeight, modifier[i], planeCount[i], planes[i], &dma[i])) {
+			global_pipe.msg("Texture %d doesn't fit the layout it came with\n", i);
+			for(uint8_t j = 0; j < 3; j++) close(fds[j]);
+			{
+				std::unique_lock lock(destroyLock);
+				pendingDestroy.push_back(theirs[0]);
+			}
+			*pOutSwapTextureSet = {0};
+			return;
+		}
+	}
+
 	for(uint8_t i = 0; i < 3; i++) {
-		global_pipe.msg("Importing texture %d\n", i);
-		struct DmabufAttributes_t dma = {
-			.pNext = nullptr,
-			.unWidth = pSwapTextureSetDesc->nWidth,
-			.unHeight = pSwapTextureSetDesc->nHeight,
-			.unDepth = 1,
-			.unMipLevels = 1,
-			.unArrayLayers = 1,
-			.unSampleCount = 1,
-			// This fits VkFormat 43 R8G8B8A8 I think
-			.unFormat = DRM_FORMAT_ABGR8888,
-			.ulModifier = DRM_FORMAT_MOD_LINEAR,
-			.unPlaneCount = 1,
-			.plane = {{
-				.unOffset = 0,
-				.unStride = pitches[i],
-				.nFd = fds[i],
-			}}
-		};
+		global_pipe.msg("Importing texture %d with modifier %016lx and %d planes\n", i, modifier[i], planeCount[i]);
 		vr::SharedTextureHandle_t sharedHandle = 0;
 		global_pipe.msg("Begin remote call %lu, %u\n", sharedHandle, unPid);
-		uint64_t success = resMan->ImportDmabuf(vr::EVRApplicationType::VRApplication_Other, &dma, &sharedHandle);
-		close(fds[i]);
+		uint64_t success = resMan->ImportDmabuf(vr::EVRApplicationType::VRApplication_Other, &dma[i], &sharedHandle);
+		set.fds[i] = fds[i];
 		if(success != 1) {
 			global_pipe.msg("Import Dmabuf failed %d\n", success);
 			abort();
 		}
 
-		pids[i] = unPid;
 		ours[i] = sharedHandle;
 		pOutSwapTextureSet->rSharedTextureHandles[i] = sharedHandle;
-		global_pipe.msg("Texture %d ref %p imported %p for %d\n", i, theirs[i], ours[i], pids[i]);
+		global_pipe.msg("Texture %d ref %p imported %p for %d\n", i, theirs[i], ours[i], set.owner);
+	}
+
+	{
+		std::unique_lock lock(setsLock);
+		sets.push_back(set);
+		global_pipe.msg("We now hold %d sets\n", sets.size());
 	}
-	global_pipe.msg("We now hold %d textures\n", refs);
 	global_pipe.msg("ret %d %p %p %p\n", pOutSwapTextureSet->unTextureFlags, pOutSwapTextureSet->rSharedTextureHandles[0], pOutSwapTextureSet->rSharedTextureHandles[1], pOutSwapTextureSet->rSharedTextureHandles[2]);
 }
 void VRDriverDirect::DestroySwapTextureSet( vr::SharedTextureHandle_t sharedTextureHandle ) {
+	ZoneScoped;
 	global_pipe.msg("call DestroySwapTextureSet(%p)\n", sharedTextureHandle);
 
+	struct SwapSet set;
+	{
+		std::unique_lock lock(setsLock);
+		size_t i = 0;
+		if(!FindFromOurs(sharedTextureHandle, &i)) {
+			global_pipe.msg("Unknown our ref %p skip\n", sharedTextureHandle);
+			return;
+		}
 
-	size_t i = 0;
-	if(!FindFromOurs(sharedTextureHandle, &i)) {
-		global_pipe.msg("Unknown our ref %p skip\n", sharedTextureHandle);
+		set = sets[i];
+		// Order doesn't matter, move the last one into the hole
+		sets[i] = sets.back();
+		sets.pop_back();
 	}
 
+	// Any handle in the set names the whole set
 	IVRIPCResourceManagerClient2 *resMan = (IVRIPCResourceManagerClient2*)vr::VRIPCResourceManager();
-	resMan->UnrefResource(ourRefs[i]);
+	for(uint8_t i = 0; i < 3; i++) {
+		resMan->UnrefResource(set.ours[i]);
+		close(set.fds[i]);
+	}
 
-	if(i != refs-1) {
-		// We need to copy something into this slot. We don't swap since we are
-		// going to free the other slot anyway
-		theirRefs[i] = theirRefs[refs-1];
-		ourRefs[i] = ourRefs[refs-1];
-		owner[i] = owner[refs-1];
+	{
+		std::unique_lock lock(destroyLock);
+		pendingDestroy.push_back(set.theirs[0]);
 	}
 
-	refs--;
 	global_pipe.msg("ret\n");
 }
 void VRDriverDirect::DestroyAllSwapTextureSets( uint32_t unPid ) {
+	ZoneScoped;
 	global_pipe.msg("call DestroyAllSwapTextureSets(%d)\n", unPid);
 
 	IVRIPCResourceManagerClient2 *resMan = (IVRIPCResourceManagerClient2*)vr::VRIPCResourceManager();
-	size_t dst = 0;
-	for(size_t i = 0; i < refs; i++) {
-		if(owner[i] == unPid) {
-			resMan->UnrefResource(ourRefs[i]);
-			continue;
-		}
+	{
+		std::unique_lock lock(setsLock);
+		size_t dst = 0;
+		for(size_t i = 0; i < sets.size(); i++) {
+			if(sets[i].owner == unPid) {
+				for(uint8_t j = 0; j < 3; j++) {
+					resMan->UnrefResource(sets[i].ours[j]);
+					close(sets[i].fds[j]);
+				}
+				continue;
+			}
 
-		owner[dst] = owner[i];
-		ourRefs[dst] = ourRefs[i];
-		theirRefs[dst] = theirRefs[i];
-		dst++;
+			sets[dst++] = sets[i];
+		}
+		global_pipe.msg("Destroyed %d sets\n", sets.size() - dst);
+		sets.resize(dst);
 	}
-	global_pipe.msg("Destroyed %d textures\n", refs - dst);
 
-	refs = dst;
+	{
+		std::unique_lock lock(destroyLock);
+		pendingDestroyAll.push_back(unPid);
+	}
 
 	global_pipe.msg("ret\n");
 }
+void VRDriverDirect::TakeDestroyed(std::vector<vr::SharedTextureHandle_t> *handles, std::vector<uint32_t> *pids) {
+	std::unique_lock lock(destroyLock);
+	handles->swap(pendingDestroy);
+	pids->swap(pendingDestroyAll);
+}
+void VRDriverDirect::FlushDestroyed() {
+	ZoneScoped;
+	if(!async) {
+		SendDestroyed();
+		return;
+	}
+
+	std::unique_lock lock(senderLock);
+	uint64_t ticket = ++flushRequests;
+	senderCond.notify_one();
+	flushCond.wait(lock, [&] { return flushesDone >= ticket || senderStop; });
+}
+void VRDriverDirect::WaitForSender() {
+	ZoneScoped;
+	std::unique_lock lock(senderLock);
+	flushCond.wait(lock, [&] { return (!framePending && !frameSending) || senderStop; });
+}
+void VRDriverDirect::SendDestroyed() {
+	ZoneScoped;
+	std::vector<vr::SharedTextureHandle_t> handles;
+	std::vector<uint32_t> pids;
+	TakeDestroyed(&handles, &pids);
+
+	if(!handles.empty()) {
+		global_pipe.msg("Forwarding destruction of %d sets\n", handles.size());
+		uint32_t count = handles.size();
+
+		global_pipe.begin_call(METH_DIRECT_DSWAP);
+		global_pipe.send_handle(this->objId);
+		global_pipe.send(&count, sizeof(count));
+		global_pipe.send(handles.data(), count * sizeof(handles[0]));
+
+		global_pipe.wait_for_return();
+		global_pipe.return_read_channel();
+	}
+
+	if(!pids.empty()) {
+		global_pipe.msg("Forwarding destruction of sets from %d processes\n", pids.size());
+		uint32_t count = pids.size();
+
+		global_pipe.begin_call(METH_DIRECT_DSWAPALL);
+		global_pipe.send_handle(this->objId);
+		global_pipe.send(&count, sizeof(count));
+		global_pipe.send(pids.data(), count * sizeof(pids[0]));
+
+		global_pipe.wait_for_return();
+		global_pipe.return_read_channel();
+	}
+}
 bool VRDriverDirect::TranslateToTheirs(vr::SharedTextureHandle_t ours, vr::SharedTextureHandle_t *theirs) {
-	size_t i = 0;
 	*theirs = 0;
 	if(ours == 0) return true; // our 0 explicitly maps to their 0
-	if(!FindFromOurs(ours, &i)) return false;
-	*theirs = theirRefs[i];
-	return true;
-}
-void VRDriverDirect::MapTextures(vr::SharedTextureHandle_t **ours, vr::SharedTextureHandle_t **theirs, uint32_t **pids) {
-	// Make sure we have space for 3 textures
-	assert(refs <= (sizeof(ourRefs)/sizeof(ourRefs[0])) - 3);
-
-	*ours = ourRefs + refs;
-	*theirs = theirRefs + refs;
-	*pids = owner + refs;
 
-	refs += 3;
+	std::unique_lock lock(setsLock);
+	for(const struct SwapSet &set : sets) {
+		for(uint8_t i = 0; i < 3; i++) {
+			if(set.ours[i] == ours) {
+				*theirs = set.theirs[i];
+				return true;
+			}
+		}
+	}
+	return false;
 }
 bool VRDriverDirect::FindFromOurs(vr::SharedTextureHandle_t needle, size_t *index) {
 	if(needle == 0) return false;
 
-	for(; *index < refs; (*index)++) {
-		if(ourRefs[*index] == needle) {
-			return true;
+	for(; *index < sets.size(); (*index)++) {
+		for(uint8_t i = 0; i < 3; i++) {
+			if(sets[*index].ours[i] == needle) {
+				return true;
+			}
 		}
 	}
 	return false;
 }
-void VRDriverDirect::GetNextSwapTextureSetIndex( vr::SharedTextureHandle_t sharedTextureHandles[ 2 ], uint32_t( *pIndices )[ 2 ] ) {
-#if 0
-	STUB(global_pipe);
-	return;
-#else
-	global_pipe.msg("call GetNextSwapTextureSetIndex(%p, %p, %p)\n", sharedTextureHandles[0], sharedTextureHandles[1], pIndices);
+void VRDriverDirect::ExportFences(vr::SharedTextureHandle_t sync, const std::vector<struct FrameLayer> &layers, std::vector<int> *fences) {
+	ZoneScoped;
+	std::unique_lock lock(setsLock);
+	// Every texture once, no matter how many layers or eyes use it. The
+	// layers already carry their handles.
+	for(const struct SwapSet &set : sets) {
+		for(uint8_t j = 0; j < 3; j++) {
+			bool used = set.ours[j] == sync;
+			for(const struct FrameLayer &layer : layers) {
+				for(uint8_t i = 0; i < 2; i++) {
+					used |= layer.perEye[i].hTexture == set.theirs[j];
+					used |= layer.perEye[i].hDepthTexture == set.theirs[j];
+				}
+			}
+			if(!used) continue;
 
-	vr::SharedTextureHandle_t theirRef[2];
+			int fence = fence_export(set.fds[j]);
+			if(fence != -1) fences->push_back(fence);
+		}
+	}
+}
+bool VRDriverDirect::PredictNext(vr::SharedTextureHandle_t handles[2], uint32_t (*indices)[2]) {
+	struct NextCall call = {0};
+	size_t found[2];
+
+	std::unique_lock lock(setsLock);
 	for(uint8_t i = 0; i < 2; i++) {
-		if(!TranslateToTheirs(sharedTextureHandles[i], &theirRef[i])) {
-			global_pipe.msg("Unknown our ref %p skip\n", sharedTextureHandles[i]);
-			theirRefs[i] = 0;
-			//return;
+		if(handles[i] == 0) {
+			found[i] = SIZE_MAX;
+			continue;
 		}
+
+		found[i] = 0;
+		if(!FindFromOurs(handles[i], &found[i])) return false;
+		if(!sets[found[i]].rotates) return false;
 	}
 
+	for(uint8_t i = 0; i < 2; i++) {
+		if(found[i] == SIZE_MAX) continue;
+
+		struct SwapSet *set = &sets[found[i]];
+		// Both eyes usually render to the same set, that only advances it once
+		if(i == 0 || found[1] != found[0]) {
+			set->current = (set->current + 1) % 3;
+		}
+		(*indices)[i] = set->current;
+
+		for(uint8_t j = 0; j < 3; j++) {
+			if(set->ours[j] == handles[i]) call.theirs[i] = set->theirs[j];
+		}
+		call.indices[i] = set->current;
+	}
+	lock.unlock();
+
+	std::unique_lock frame(frameLock);
+	pendingNext.push_back(call);
+	return true;
+}
+void VRDriverDirect::LearnNext(vr::SharedTextureHandle_t handles[2], uint32_t (*indices)[2]) {
+	std::unique_lock lock(setsLock);
+	size_t found[2] = {SIZE_MAX, SIZE_MAX};
+	for(uint8_t i = 0; i < 2; i++) {
+		size_t j = 0;
+		if(!FindFromOurs(handles[i], &j)) continue;
+		found[i] = j;
+		// Both eyes in one set only advance it once
+		if(i == 1 && found[0] == j) continue;
+
+		struct SwapSet *set = &sets[j];
+		set->rotates = set->current >= 0 && (*indices)[i] == (uint32_t)(set->current + 1) % 3;
+		set->current = (*indices)[i];
+	}
+}
+void VRDriverDirect::SendNext(const vr::SharedTextureHandle_t theirs[2], uint32_t (*indices)[2]) {
 	global_pipe.begin_call(METH_DIRECT_NEXT);
-	global_pipe.send(&this->objId, sizeof(objId));
+	global_pipe.send_handle(this->objId);
 
-	global_pipe.send(&theirRef[0], sizeof(theirRef[0]));
-	global_pipe.send(&theirRef[1], sizeof(theirRef[1]));
-	global_pipe.send(pIndices, sizeof(*pIndices));
+	global_pipe.send(&theirs[0], sizeof(theirs[0]));
+	global_pipe.send(&theirs[1], sizeof(theirs[1]));
+	global_pipe.send(indices, sizeof(*indices));
 
 	global_pipe.wait_for_return();
 
-	global_pipe.recv(pIndices, sizeof(*pIndices));
+	global_pipe.recv(indices, sizeof(*indices));
 
 	global_pipe.return_read_channel();
-
-	global_pipe.msg("ret %d %d\n", (*pIndices)[0], (*pIndices)[1]);
-#endif
 }
-void VRDriverDirect::SubmitLayer( const SubmitLayerPerEye_t( &perEye )[ 2 ] ) {
-	global_pipe.msg("call SubmitLayer(%p, %p, %p, %p)\n", perEye[0].hTexture, perEye[0].hDepthTexture, perEye[1].hTexture, perEye[1].hDepthTexture);
+void VRDriverDirect::ReplayNext() {
+	ZoneScoped;
+	std::vector<struct NextCall> replay;
+	{
+		std::unique_lock lock(frameLock);
+		replay.swap(pendingNext);
+	}
+	if(replay.empty()) return;
+
+	global_pipe.msg("Replaying %d predicted index calls\n", replay.size());
+	for(struct NextCall &call : replay) {
+		uint32_t indices[2] = {call.indices[0], call.indices[1]};
+		SendNext(call.theirs, &indices);
+		if(indices[0] != call.indices[0] || indices[1] != call.indices[1]) {
+			global_pipe.msg("Predicted %d %d, the driver said %d %d\n", call.indices[0], call.indices[1], indices[0], indices[1]);
+		}
+	}
+}
+void VRDriverDirect::GetNextSwapTextureSetIndex( vr::SharedTextureHandle_t sharedTextureHandles[ 2 ], uint32_t( *pIndices )[ 2 ] ) {
+	ZoneScoped;
+	global_pipe.msg("call GetNextSwapTextureSetIndex(%p, %p, %p)\n", sharedTextureHandles[0], sharedTextureHandles[1], pIndices);
 
-	vr::SharedTextureHandle_t ourRef[4] = {0};
-	for(uint8_t i = 0; i < 2; i++) {
-		ourRef[i] = perEye[i].hTexture;
-		ourRef[i+2] = perEye[i].hDepthTexture;
+	if(predictNext && PredictNext(sharedTextureHandles, pIndices)) {
+		global_pipe.msg("ret %d %d (predicted)\n", (*pIndices)[0], (*pIndices)[1]);
+		return;
 	}
 
-	vr::SharedTextureHandle_t theirRef[4] = {0};
-	for(uint8_t i = 0; i < 4; i++) {
-		if(!TranslateToTheirs(ourRef[i], &theirRef[i])) {
-			global_pipe.msg("Unknown our ref %p\n", ourRef[i]);
-			return;
+	vr::SharedTextureHandle_t theirRef[2];
+	for(uint8_t i = 0; i < 2; i++) {
+		if(!TranslateToTheirs(sharedTextureHandles[i], &theirRef[i])) {
+			global_pipe.msg("Unknown our ref %p skip\n", sharedTextureHandles[i]);
 		}
 	}
 
-	global_pipe.begin_call(METH_DIRECT_SUBMIT);
-	global_pipe.send(&this->objId, sizeof(objId));
+	// Everything vrserver did before this has to reach the driver first. In
+	// async mode that's the frame the sender might still hold, then the
+	// predicted calls that haven't gone out yet.
+	if(async) WaitForSender();
+	bool replay;
+	{
+		std::unique_lock lock(frameLock);
+		replay = !pendingNext.empty();
+	}
+	if(replay || replayNext.exchange(false)) {
+		ReplayNext();
+	}
 
-	for(uint8_t i = 0; i < 2; i++) {
-		global_pipe.send(&theirRef[i], sizeof(theirRef[i]));
-		global_pipe.send(&theirRef[i+2], sizeof(theirRef[i+2]));
+	SendNext(theirRef, pIndices);
+
+	LearnNext(sharedTextureHandles, pIndices);
 
-		global_pipe.send(&perEye[i].bounds, sizeof(perEye[i].bounds));
-		global_pipe.send(&perEye[i].mProjection, sizeof(perEye[i].mProjection));
-		global_pipe.send(&perEye[i].mHmdPose, sizeof(perEye[i].mHmdPose));
-		global_pipe.send(&perEye[i].flHmdPosePredictionTimeInSecondsFromNow, sizeof(perEye[i].flHmdPosePredictionTimeInSecondsFromNow));
+	global_pipe.msg("ret %d %d\n", (*pIndices)[0], (*pIndices)[1]);
+}
+void VRDriverDirect::SubmitLayer( const SubmitLayerPerEye_t( &perEye )[ 2 ] ) {
+	ZoneScoped;
+	global_pipe.msg("call SubmitLayer(%p, %p, %p, %p)\n", perEye[0].hTexture, perEye[0].hDepthTexture, perEye[1].hTexture, perEye[1].hDepthTexture);
+
+	struct FrameLayer layer;
+	for(uint8_t i = 0; i < 2; i++) {
+		layer.perEye[i] = perEye[i];
+		if(!TranslateToTheirs(perEye[i].hTexture, &layer.perEye[i].hTexture)) {
+			global_pipe.msg("Unknown our ref %p\n", perEye[i].hTexture);
+			return;
+		}
+		if(!TranslateToTheirs(perEye[i].hDepthTexture, &layer.perEye[i].hDepthTexture)) {
+			global_pipe.msg("Unknown our ref %p\n", perEye[i].hDepthTexture);
+			return;
+		}
 	}
 
-	global_pipe.wait_for_return();
-	global_pipe.return_read_channel();
+	std::unique_lock lock(frameLock);
+	layers.push_back(layer);
 
 	global_pipe.msg("ret\n");
 }
 void VRDriverDirect::Present( vr::SharedTextureHandle_t syncTexture ) {
+	ZoneScoped;
 	global_pipe.msg("call Present(%p)\n", syncTexture);
 
-	vr::SharedTextureHandle_t theirRef;
-	if(!TranslateToTheirs(syncTexture, &theirRef)) {
+	struct Frame frame;
+	if(!TranslateToTheirs(syncTexture, &frame.sync)) {
 		global_pipe.msg("Unknown our ref %p skip\n", syncTexture);
+		// Drop the layers, but keep the index calls around. The driver still
+		// has to see those to stay in step with us.
+		std::unique_lock lock(frameLock);
+		layers.clear();
 		return;
 	}
 
-	global_pipe.begin_call(METH_DIRECT_PRESENT);
-	global_pipe.send(&this->objId, sizeof(objId));
+	{
+		std::unique_lock lock(frameLock);
+		frame.nexts.swap(pendingNext);
+		frame.layers.swap(layers);
+		frame.throttle = throttling;
+	}
+	TakeDestroyed(&frame.destroyed, &frame.destroyedPids);
 
-	global_pipe.send(&theirRef, sizeof(theirRef));
+	// vrserver has submitted its rendering when it calls us, but it might
+	// not be done yet. The Windows driver waits for these rather than
+	// whatever implicit sync it gets through the dmabuf.
+	if(global_pipe.has_cap(PIPE_CAP_FRAME_FENCE)) {
+		ExportFences(syncTexture, frame.layers, &frame.fences);
+	}
 
-	global_pipe.wait_for_return();
-	global_pipe.return_read_channel();
+	// Everything after this belongs to the next frame
+	frame.number = global_pipe.frame++;
+	auto now = std::chrono::steady_clock::now();
+	frame.queued = now;
+	frame.interval = now - lastPresent;
+	lastPresent = now;
+
+	if(async) {
+		QueueFrame(&frame);
+	} else {
+		SendFrame(&frame);
+	}
+	FrameMark;
 
 	global_pipe.msg("ret\n");
 }
-void VRDriverDirect::PostPresent( const Throttling_t *pThrottling ) {
-	global_pipe.msg("call PostPresent(%p)\n", pThrottling);
+void VRDriverDirect::SendFrame(struct Frame *frame) {
+	ZoneScoped;
+	global_pipe.begin_call(METH_DIRECT_FRAME);
+	global_pipe.send_handle(this->objId);
+	global_pipe.send(&frame->number, sizeof(frame->number));
+
+	uint32_t nextCount = frame->nexts.size();
+	global_pipe.send(&nextCount, sizeof(nextCount));
+	for(const struct NextCall &call : frame->nexts) {
+		global_pipe.send(&call.theirs[0], sizeof(call.theirs[0]));
+		global_pipe.send(&call.theirs[1], sizeof(call.theirs[1]));
+		global_pipe.send(call.indices, sizeof(call.indices));
+	}
 
-	global_pipe.begin_call(METH_DIRECT_POSTPRES);
-	global_pipe.send(&this->objId, sizeof(objId));
+	uint32_t layerCount = frame->layers.size();
+	global_pipe.send(&layerCount, sizeof(layerCount));
+	for(const struct FrameLayer &layer : frame->layers) {
+		for(uint8_t i = 0; i < 2; i++) {
+			const SubmitLayerPerEye_t *eye = &layer.perEye[i];
+			global_pipe.send(&eye->hTexture, sizeof(eye->hTexture));
+			global_pipe.send(&eye->hDepthTexture, sizeof(eye->hDepthTexture));
+
+			global_pipe.send(&eye->bounds, sizeof(eye->bounds));
+			global_pipe.send(&eye->mProjection, sizeof(eye->mProjection));
+			global_pipe.send(&eye->mHmdPose, sizeof(eye->mHmdPose));
+			global_pipe.send(&eye->flHmdPosePredictionTimeInSecondsFromNow, sizeof(eye->flHmdPosePredictionTimeInSecondsFromNow));
+		}
+	}
 
-	global_pipe.send(pThrottling, sizeof(*pThrottling));
+	global_pipe.send(&frame->sync, sizeof(frame->sync));
+	uint32_t fenceCount = frame->fences.size();
+	global_pipe.send(&fenceCount, sizeof(fenceCount));
+	for(int fence : frame->fences) {
+		global_pipe.send_fd(fence);
+	}
+	// Waiting longer than a frame on the fences just stalls the next one.
+	// The first frame has no interval, it gets the cap.
+	auto fenceWait = std::chrono::ceil<std::chrono::milliseconds>(std::min<std::chrono::steady_clock::duration>(frame->interval, std::chrono::milliseconds(MaxFenceWaitMs)));
+	uint32_t fenceWaitMs = fenceWait.count();
+	global_pipe.send(&fenceWaitMs, sizeof(fenceWaitMs));
+	// PostPresent comes after this, so the driver gets last frame's throttling.
+	// It practically never changes.
+	global_pipe.send(&frame->throttle, sizeof(frame->throttle));
+
+	uint32_t destroyCount = frame->destroyed.size();
+	global_pipe.send(&destroyCount, sizeof(destroyCount));
+	global_pipe.send(frame->destroyed.data(), destroyCount * sizeof(frame->destroyed[0]));
+	uint32_t destroyPidCount = frame->destroyedPids.size();
+	global_pipe.send(&destroyPidCount, sizeof(destroyPidCount));
+	global_pipe.send(frame->destroyedPids.data(), destroyPidCount * sizeof(frame->destroyedPids[0]));
 
 	global_pipe.wait_for_return();
+
+	bool inStep;
+	global_pipe.recv(&inStep, sizeof(inStep));
+
 	global_pipe.return_read_channel();
 
-	global_pipe.msg("ret\n");
+	for(int fence : frame->fences) close(fence);
+	frame->fences.clear();
+
+	if(!inStep && predictNext) {
+		global_pipe.msg("Windows driver disagrees with our swap set indices, asking it from now on\n");
+		predictNext = false;
+		replayNext = true;
+	}
 }
-void VRDriverDirect::GetFrameTiming( DriverDirectMode_FrameTiming *pFrameTiming ) {
-	global_pipe.msg("call GetFrameTiming(%p)\n", pFrameTiming);
+void VRDriverDirect::QueueFrame(struct Frame *frame) {
+	ZoneScoped;
+	std::unique_lock lock(senderLock);
+	if(framePending) {
+		// The sender didn't get to the last frame yet, so we replace it. The
+		// index calls and destruction have to reach the driver regardless.
+		frame->nexts.insert(frame->nexts.begin(), pendingFrame.nexts.begin(), pendingFrame.nexts.end());
+		frame->destroyed.insert(frame->destroyed.begin(), pendingFrame.destroyed.begin(), pendingFrame.destroyed.end());
+		frame->destroyedPids.insert(frame->destroyedPids.begin(), pendingFrame.destroyedPids.begin(), pendingFrame.destroyedPids.end());
+		for(int fence : pendingFrame.fences) close(fence);
+		stats.dropped++;
+	}
 
-	global_pipe.begin_call(METH_DIRECT_FTIME);
-	global_pipe.send(&this->objId, sizeof(objId));
+	pendingFrame = std::move(*frame);
+	framePending = true;
 
-	global_pipe.wait_for_return();
+	senderCond.notify_one();
+}
+void VRDriverDirect::SenderThread(VRDriverDirect *self) {
+	global_pipe.msg("Async present sender started\n");
+	while(true) {
+		struct Frame frame;
+		bool haveFrame;
+		uint64_t flushTicket;
+		{
+			std::unique_lock lock(self->senderLock);
+			self->senderCond.wait(lock, [&] {
+				return self->framePending || self->flushRequests != self->flushesDone || self->senderStop;
+			});
+			if(self->senderStop) break;
+			haveFrame = self->framePending;
+			if(haveFrame) {
+				frame = std::move(self->pendingFrame);
+				self->framePending = false;
+				self->frameSending = true;
+			}
+			flushTicket = self->flushRequests;
+		}
 
-	global_pipe.recv(pFrameTiming, sizeof(*pFrameTiming));
+		if(haveFrame) {
+			// It sat in the queue for longer than it took vrserver to produce
+			// it, we're not keeping up.
+			if(std::chrono::steady_clock::now() - frame.queued > frame.interval) {
+				self->stats.late++;
+			}
 
-	global_pipe.return_read_channel();
+			self->SendFrame(&frame);
+			{
+				std::unique_lock lock(self->senderLock);
+				self->frameSending = false;
+			}
+			self->flushCond.notify_all();
+			self->stats.sent++;
+			TracyPlot("Async dropped", (int64_t)self->stats.dropped.load());
+			TracyPlot("Async late", (int64_t)self->stats.late.load());
+			self->ReportStats();
+		}
+
+		// Only we write flushesDone, so it's fine to read without the lock
+		if(flushTicket != self->flushesDone) {
+			self->SendDestroyed();
+			{
+				std::unique_lock lock(self->senderLock);
+				self->flushesDone = flushTicket;
+			}
+			self->flushCond.notify_all();
+		}
+	}
+	global_pipe.msg("Async present sender stopped\n");
+}
+void VRDriverDirect::ReportStats() {
+	auto now = std::chrono::steady_clock::now();
+	if(now - stats.lastReport < std::chrono::seconds(10)) return;
+	stats.lastReport = now;
+
+	global_pipe.msg("Async present: %lu sent, %lu dropped, %lu late\n", stats.sent.load(), stats.dropped.load(), stats.late.load());
+}
+void VRDriverDirect::PostPresent( const Throttling_t *pThrottling ) {
+	ZoneScoped;
+	global_pipe.msg("call PostPresent(%p)\n", pThrottling);
+
+	// Rides along with the next frame
+	std::unique_lock lock(frameLock);
+	throttling = *pThrottling;
+
+	global_pipe.msg("ret\n");
+}
+void VRDriverDirect::GetFrameTiming( DriverDirectMode_FrameTiming *pFrameTiming ) {
+	ZoneScoped;
+	global_pipe.msg("call GetFrameTiming(%p)\n", pFrameTiming);
+
+	static_assert(sizeof(DriverDirectMode_FrameTiming) <= sizeof(FrameTimingSlot::data));
+	// The dllhost publishes once when the slot is handed over, so this only
+	// fails if it somehow didn't
+	if(!timing->read(pFrameTiming, sizeof(*pFrameTiming))) {
+		uint32_t size = pFrameTiming->m_nSize;
+		memset(pFrameTiming, 0, sizeof(*pFrameTiming));
+		pFrameTiming->m_nSize = size;
+	}
 
 	global_pipe.msg("ret\n");
 }
@@ -410,7 +915,7 @@ void VRDisplayComponent::GetWindowBounds( int32_t *pnX, int32_t *pnY, uint32_t *
 	global_pipe.msg("call GetWindowBounds(%p, %p, %p, %p)\n", pnX, pnY, pnWidth, pnHeight);
 
 	global_pipe.begin_call(METH_COMP_WINSIZE);
-	global_pipe.send(&this->objId, sizeof(uint64_t));
+	global_pipe.send_handle(this->objId);
 
 	global_pipe.wait_for_return();
 
@@ -426,7 +931,7 @@ bool VRDisplayComponent::IsDisplayOnDesktop( ) {
 	global_pipe.msg("call IsDisplayOnDesktop()\n");
 
 	global_pipe.begin_call(METH_COMP_ONDESKTOP);
-	global_pipe.send(&this->objId, sizeof(uint64_t));
+	global_pipe.send_handle(this->objId);
 
 	global_pipe.wait_for_return();
 
@@ -441,7 +946,7 @@ bool VRDisplayComponent::IsDisplayRealDisplay( ) {
 	global_pipe.msg("call IsDisplayRealDisplay()\n");
 
 	global_pipe.begin_call(METH_COMP_REALDISPLAY);
-	global_pipe.send(&this->objId, sizeof(uint64_t));
+	global_pipe.send_handle(this->objId);
 
 	global_pipe.wait_for_return();
 
@@ -456,7 +961,7 @@ void VRDisplayComponent::GetRecommendedRenderTargetSize( uint32_t *pnWidth, uint
 	global_pipe.msg("call GetRecommendedRenderTargetSize(%p, %p)\n", pnWidth, pnHeight);
 
 	global_pipe.begin_call(METH_COMP_TARGETSIZE);
-	global_pipe.send(&this->objId, sizeof(uint64_t));
+	global_pipe.send_handle(this->objId);
 
 	global_pipe.wait_for_return();
 
@@ -470,7 +975,7 @@ void VRDisplayComponent::GetEyeOutputViewport( vr::EVREye eEye, uint32_t *pnX, u
 	global_pipe.msg("call GetEyeOutputViewport(%d, %p, %p, %p, %p)\n", eEye, pnX, pnY, pnWidth, pnHeight);
 
 	global_pipe.begin_call(METH_COMP_EYEVIEWPORT);
-	global_pipe.send(&this->objId, sizeof(uint64_t));
+	global_pipe.send_handle(this->objId);
 	global_pipe.send(&eEye, sizeof(vr::EVREye));
 
 	global_pipe.wait_for_return();
@@ -487,7 +992,7 @@ void VRDisplayComponent::GetProjectionRaw( vr::EVREye eEye, float *pfLeft, float
 	global_pipe.msg("call GetProjectionRaw(%d, %p, %p, %p, %p)\n", eEye, pfLeft, pfRight, pfTop, pfBottom);
 
 	global_pipe.begin_call(METH_COMP_PROJRAW);
-	global_pipe.send(&this->objId, sizeof(uint64_t));
+	global_pipe.send_handle(this->objId);
 	global_pipe.send(&eEye, sizeof(vr::EVREye));
 
 	global_pipe.wait_for_return();
@@ -504,7 +1009,7 @@ vr::DistortionCoordinates_t VRDisplayComponent::ComputeDistortion( vr::EVREye eE
 	global_pipe.msg("call ComputeDistortion(%d, %f, %f)\n", eEye, fU, fV);
 
 	global_pipe.begin_call(METH_COMP_DISTORTION);
-	global_pipe.send(&this->objId, sizeof(uint64_t));
+	global_pipe.send_handle(this->objId);
 	global_pipe.send(&eEye, sizeof(eEye));
 	global_pipe.send(&fU, sizeof(fU));
 	global_pipe.send(&fV, sizeof(fV));
@@ -525,6 +1030,7 @@ bool VRDisplayComponent::ComputeInverseDistortion( vr::HmdVector2_t *pResult, vr
 
 class TrackedDeviceServerDriver : public vr::ITrackedDeviceServerDriver {
 	size_t objId;
+	uint32_t objectId = vr::k_unTrackedDeviceIndexInvalid;
 
 	public:
 	TrackedDeviceServerDriver(size_t objId) : objId(objId) {};
@@ -541,7 +1047,7 @@ EVRInitError TrackedDeviceServerDriver::Activate( uint32_t unObjectId ) {
 	global_pipe.msg("call Activate(%d)\n", unObjectId);
 
 	global_pipe.begin_call(METH_DEV_ACTIVATE);
-	global_pipe.send(&this->objId, sizeof(uint64_t));
+	global_pipe.send_handle(this->objId);
 	global_pipe.send(&unObjectId, sizeof(uint32_t));
 
 	global_pipe.wait_for_return();
@@ -551,10 +1057,26 @@ EVRInitError TrackedDeviceServerDriver::Activate( uint32_t unObjectId ) {
 	global_pipe.return_read_channel();
 
 	global_pipe.msg("ret %d\n", ret);
+	if(ret == vr::VRInitError_None) {
+		this->objectId = unObjectId;
+	}
 	return ret;
 }
 void TrackedDeviceServerDriver::Deactivate() {
-	STUB(global_pipe);
+	global_pipe.msg("call Deactivate()\n");
+
+	global_pipe.begin_call(METH_DEV_DEACTIVATE);
+	global_pipe.send_handle(this->objId);
+
+	global_pipe.wait_for_return();
+	global_pipe.return_read_channel();
+
+	// The driver is done with the device, so the promises for its container
+	// and components can go
+	if(this->objectId != vr::k_unTrackedDeviceIndexInvalid) {
+		global_pipe.forget(vr::VRProperties()->TrackedDeviceToPropertyContainer(this->objectId));
+		this->objectId = vr::k_unTrackedDeviceIndexInvalid;
+	}
 }
 void TrackedDeviceServerDriver::EnterStandby() {
 	STUB(global_pipe);
@@ -563,7 +1085,7 @@ void *TrackedDeviceServerDriver::GetComponent( const char *pchComponentNameAndVe
 	global_pipe.msg("call GetComponent(%s)\n", pchComponentNameAndVersion);
 
 	global_pipe.begin_call(METH_DEV_COMPONENT);
-	global_pipe.send(&this->objId, sizeof(this->objId));
+	global_pipe.send_handle(this->objId);
 	size_t nameLen = strlen(pchComponentNameAndVersion);
 	global_pipe.send(&nameLen, sizeof(nameLen));
 	global_pipe.send(pchComponentNameAndVersion, nameLen);
@@ -571,7 +1093,7 @@ void *TrackedDeviceServerDriver::GetComponent( const char *pchComponentNameAndVe
 	global_pipe.wait_for_return();
 
 	uint64_t newHandle;
-	global_pipe.recv(&newHandle, sizeof(newHandle));
+	newHandle = global_pipe.recv_handle();
 	global_pipe.return_read_channel();
 
 	if(strcmp(pchComponentNameAndVersion, vr::IVRDisplayComponent_Version) == 0) {
@@ -598,8 +1120,9 @@ DriverPose_t TrackedDeviceServerDriver::GetPose() {
 static void handler(enum PipeMethod m, void *userdata) {
 	switch(m) {
 	case METH_GET_INTERFACE: {
+		ZoneScopedN("GET_INTERFACE");
 		size_t driverHandle;
-		global_pipe.recv(&driverHandle, sizeof(size_t));
+		driverHandle = global_pipe.recv_handle();
 
 		uint64_t size;
 		global_pipe.recv(&size, sizeof(uint64_t));
@@ -623,8 +1146,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_LOG: {
+		ZoneScopedN("LOG");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRDriverLog *thisObj = ((vr::IVRDriverLog*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t len;
@@ -643,8 +1167,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_RES_LOAD: {
+		ZoneScopedN("RES_LOAD");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRResources *thisObj = ((vr::IVRResources*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t nameLen;
@@ -669,8 +1194,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_RES_PATH: {
+		ZoneScopedN("RES_PATH");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRResources *thisObj = ((vr::IVRResources*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t nameLen;
@@ -705,8 +1231,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_SETS_GBOOL: {
+		ZoneScopedN("SETS_GBOOL");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRSettings *thisObj = ((vr::IVRSettings*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t sectionLen;
@@ -736,8 +1263,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_SETS_GINT: {
+		ZoneScopedN("SETS_GINT");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRSettings *thisObj = ((vr::IVRSettings*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t sectionLen;
@@ -766,8 +1294,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_SETS_GFLT: {
+		ZoneScopedN("SETS_GFLT");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRSettings *thisObj = ((vr::IVRSettings*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t sectionLen;
@@ -796,8 +1325,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_SETS_GSTR: {
+		ZoneScopedN("SETS_GSTR");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRSettings *thisObj = ((vr::IVRSettings*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t sectionLen;
@@ -832,8 +1362,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_PATH_WRITE: {
+		ZoneScopedN("PATH_WRITE");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRPaths *thisObj = ((vr::IVRPaths*)global_pipe.objs[thisHandle-1]);
 
 		vr::PropertyContainerHandle_t root;
@@ -896,8 +1427,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_PATH_READ: {
+		ZoneScopedN("PATH_READ");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRPaths *thisObj = ((vr::IVRPaths*)global_pipe.objs[thisHandle-1]);
 
 		vr::PropertyContainerHandle_t root;
@@ -936,8 +1468,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_PATH_S2H: {
+		ZoneScopedN("PATH_S2H");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRPaths *thisObj = ((vr::IVRPaths*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t pathLen;
@@ -959,8 +1492,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_PROP_READ: {
+		ZoneScopedN("PROP_READ");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRProperties *thisObj = ((vr::IVRProperties*)global_pipe.objs[thisHandle-1]);
 
 		vr::PropertyContainerHandle_t root;
@@ -999,8 +1533,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_PROP_WRITE: {
+		ZoneScopedN("PROP_WRITE");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRProperties *thisObj = ((vr::IVRProperties*)global_pipe.objs[thisHandle-1]);
 
 		vr::PropertyContainerHandle_t root;
@@ -1039,8 +1574,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_PROP_TRANS: {
+		ZoneScopedN("PROP_TRANS");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRProperties *thisObj = ((vr::IVRProperties*)global_pipe.objs[thisHandle-1]);
 
 		vr::TrackedDeviceIndex_t dev;
@@ -1055,8 +1591,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_SERVER_DEVADD: {
+		ZoneScopedN("SERVER_DEVADD");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRServerDriverHost *thisObj = ((vr::IVRServerDriverHost*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t serialLen;
@@ -1068,7 +1605,7 @@ static void handler(enum PipeMethod m, void *userdata) {
 		global_pipe.recv(&deviceClass, sizeof(deviceClass));
 
 		size_t driverHandle;
-		global_pipe.recv(&driverHandle, sizeof(driverHandle));
+		driverHandle = global_pipe.recv_handle();
 		vr::ITrackedDeviceServerDriver *deviceDriver = new TrackedDeviceServerDriver(driverHandle);
 
 		size_t taskId = global_pipe.complete_reading_args();
@@ -1082,8 +1619,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_INPUT_CBOOL: {
+		ZoneScopedN("INPUT_CBOOL");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRDriverInput *thisObj = ((vr::IVRDriverInput*)global_pipe.objs[thisHandle-1]);
 
 		vr::PropertyContainerHandle_t container;
@@ -1094,10 +1632,19 @@ static void handler(enum PipeMethod m, void *userdata) {
 		global_pipe.recv(name, nameLen);
 		name[nameLen] = '\0';
 
+		uint64_t promise = global_pipe.recv_varint();
+
 		size_t taskId = global_pipe.complete_reading_args();
 
 		vr::VRInputComponentHandle_t handle;
 		vr::EVRInputError ret = thisObj->CreateBooleanComponent(container, name, &handle);
+		if(ret != vr::VRInputError_None) {
+			global_pipe.msg("Creating input component %s failed: %d\n", name, ret);
+			handle = vr::k_ulInvalidInputComponentHandle;
+			global_pipe.reject(promise, handle, container);
+		}else{
+			global_pipe.fulfill(promise, handle, container);
+		}
 
 		global_pipe.return_from_call(taskId);
 		global_pipe.send(&ret, sizeof(ret));
@@ -1107,12 +1654,14 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_INPUT_UBOOL: {
+		ZoneScopedN("INPUT_UBOOL");
 		uint64_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(thisHandle));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRDriverInput *thisObj = ((vr::IVRDriverInput*)global_pipe.objs[thisHandle-1]);
 
 		vr::VRInputComponentHandle_t handle;
 		global_pipe.recv(&handle, sizeof(handle));
+		handle = global_pipe.resolve(handle, vr::k_ulInvalidInputComponentHandle);
 		bool newValue;
 		global_pipe.recv(&newValue, sizeof(newValue));
 		double timeOffset;
@@ -1127,8 +1676,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_INPUT_CSCALAR: {
+		ZoneScopedN("INPUT_CSCALAR");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRDriverInput *thisObj = ((vr::IVRDriverInput*)global_pipe.objs[thisHandle-1]);
 
 		vr::PropertyContainerHandle_t container;
@@ -1143,10 +1693,19 @@ static void handler(enum PipeMethod m, void *userdata) {
 		vr::EVRScalarUnits units;
 		global_pipe.recv(&units, sizeof(units));
 
+		uint64_t promise = global_pipe.recv_varint();
+
 		size_t taskId = global_pipe.complete_reading_args();
 
 		vr::VRInputComponentHandle_t handle;
 		vr::EVRInputError ret = thisObj->CreateScalarComponent(container, name, &handle, type, units);
+		if(ret != vr::VRInputError_None) {
+			global_pipe.msg("Creating input component %s failed: %d\n", name, ret);
+			handle = vr::k_ulInvalidInputComponentHandle;
+			global_pipe.reject(promise, handle, container);
+		}else{
+			global_pipe.fulfill(promise, handle, container);
+		}
 
 		global_pipe.return_from_call(taskId);
 		global_pipe.send(&ret, sizeof(ret));
@@ -1156,12 +1715,14 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_INPUT_USCALAR: {
+		ZoneScopedN("INPUT_USCALAR");
 		uint64_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(thisHandle));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRDriverInput *thisObj = ((vr::IVRDriverInput*)global_pipe.objs[thisHandle-1]);
 
 		vr::VRInputComponentHandle_t handle;
 		global_pipe.recv(&handle, sizeof(handle));
+		handle = global_pipe.resolve(handle, vr::k_ulInvalidInputComponentHandle);
 		float newValue;
 		global_pipe.recv(&newValue, sizeof(newValue));
 		double timeOffset;
@@ -1176,8 +1737,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_INPUT_CHAPTIC: {
+		ZoneScopedN("INPUT_CHAPTIC");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(size_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRDriverInput *thisObj = ((vr::IVRDriverInput*)global_pipe.objs[thisHandle-1]);
 
 		vr::PropertyContainerHandle_t container;
@@ -1188,10 +1750,19 @@ static void handler(enum PipeMethod m, void *userdata) {
 		global_pipe.recv(name, nameLen);
 		name[nameLen] = '\0';
 
+		uint64_t promise = global_pipe.recv_varint();
+
 		size_t taskId = global_pipe.complete_reading_args();
 
 		vr::VRInputComponentHandle_t handle;
 		vr::EVRInputError ret = thisObj->CreateHapticComponent(container, name, &handle);
+		if(ret != vr::VRInputError_None) {
+			global_pipe.msg("Creating input component %s failed: %d\n", name, ret);
+			handle = vr::k_ulInvalidInputComponentHandle;
+			global_pipe.reject(promise, handle, container);
+		}else{
+			global_pipe.fulfill(promise, handle, container);
+		}
 
 		global_pipe.return_from_call(taskId);
 		global_pipe.send(&ret, sizeof(ret));
@@ -1201,8 +1772,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_MB_UNDOC1: {
+		ZoneScopedN("MB_UNDOC1");
 		uint64_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(thisHandle));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRMailbox *thisObj = ((vr::IVRMailbox*)global_pipe.objs[thisHandle-1]);
 
 		uint64_t bufSize;
@@ -1229,8 +1801,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_MB_UNDOC2: {
+		ZoneScopedN("MB_UNDOC2");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRMailbox *thisObj = ((vr::IVRMailbox*)global_pipe.objs[thisHandle-1]);
 
 		vr::vrmb_typea arg1;
@@ -1246,8 +1819,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_MB_UNDOC3: {
+		ZoneScopedN("MB_UNDOC3");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRMailbox *thisObj = ((vr::IVRMailbox*)global_pipe.objs[thisHandle-1]);
 
 		vr::vrmb_typea arg1;
@@ -1279,8 +1853,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_MB_UNDOC4: {
+		ZoneScopedN("MB_UNDOC4");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRMailbox *thisObj = ((vr::IVRMailbox*)global_pipe.objs[thisHandle-1]);
 
 		vr::vrmb_typea arg1;
@@ -1304,8 +1879,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_SERVER_POSE: {
+		ZoneScopedN("SERVER_POSE");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRServerDriverHost *thisObj = ((vr::IVRServerDriverHost*)global_pipe.objs[thisHandle-1]);
 
 		uint32_t device;
@@ -1322,8 +1898,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_SERVER_VSYNC: {
+		ZoneScopedN("SERVER_VSYNC");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRServerDriverHost *thisObj = ((vr::IVRServerDriverHost*)global_pipe.objs[thisHandle-1]);
 
 		double timeOffset;
@@ -1337,8 +1914,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_SERVER_VENDOR: {
+		ZoneScopedN("SERVER_VENDOR");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRServerDriverHost *thisObj = ((vr::IVRServerDriverHost*)global_pipe.objs[thisHandle-1]);
 
 		uint32_t dev;
@@ -1358,8 +1936,9 @@ static void handler(enum PipeMethod m, void *userdata) {
 		break;
 	}
 	case METH_SERVER_POLL: {
+		ZoneScopedN("SERVER_POLL");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRServerDriverHost *thisObj = ((vr::IVRServerDriverHost*)global_pipe.objs[thisHandle-1]);
 
 		uint32_t eventSize;
@@ -1369,17 +1948,23 @@ static void handler(enum PipeMethod m, void *userdata) {
 		size_t taskId = global_pipe.complete_reading_args();
 
 		bool ret = thisObj->PollNextEvent(buf, eventSize);
+		// The driver only knows the handles it was promised
+		if(ret && buf->eventType == vr::VREvent_Input_HapticVibration) {
+			vr::VREvent_HapticVibration_t *haptic = &buf->data.hapticVibration;
+			haptic->componentHandle = global_pipe.promise_of(haptic->componentHandle);
+		}
 
 		global_pipe.return_from_call(taskId);
 		global_pipe.send(&ret, sizeof(ret));
-		global_pipe.send(&buf, eventSize);
+		global_pipe.send(buf, eventSize);
 
 		free(buf);
 		break;
 	}
 	case METH_SERVER_PROJ: {
+		ZoneScopedN("SERVER_PROJ");
 		size_t thisHandle;
-		global_pipe.recv(&thisHandle, sizeof(uint64_t));
+		thisHandle = global_pipe.recv_handle();
 		vr::IVRServerDriverHost *thisObj = ((vr::IVRServerDriverHost*)global_pipe.objs[thisHandle-1]);
 
 		uint32_t dev;
@@ -1433,8 +2018,7 @@ extern "C" __attribute__((visibility("default"))) void* HmdDriverFactory(const c
 		global_pipe.send(pInterfaceName, nameLen);
 
 		global_pipe.wait_for_return();
-		handle retObj;
-		global_pipe.recv(&retObj, sizeof(handle));
+		handle retObj = global_pipe.recv_handle();
 		global_pipe.recv(pReturnCode, sizeof(int));
 		global_pipe.return_read_channel();
 
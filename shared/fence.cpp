@@ -0,0 +1,71 @@
+#include "fence.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <linux/dma-buf.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// Only in 6.0+ headers
+#ifndef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+struct dma_buf_export_sync_file {
+	uint32_t flags;
+	int32_t fd;
+};
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE _IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+#endif
+
+int fence_export(int dmabuf) {
+	// READ gets us the fences of whoever is still writing
+	struct dma_buf_export_sync_file req = {
+		.flags = DMA_BUF_SYNC_READ,
+		.fd = -1,
+	};
+	int ret;
+	do {
+		ret = ioctl(dmabuf, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &req);
+	} while(ret == -1 && (errno == EINTR || errno == EAGAIN));
+	if(ret == 0) return req.fd;
+
+	return fence_create(true);
+}
+
+int fence_create(bool signalled) {
+	return eventfd(signalled ? 1 : 0, EFD_CLOEXEC);
+}
+
+void fence_signal(int fence) {
+	uint64_t one = 1;
+	while(write(fence, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+bool fence_wait(int fence, int timeoutMs) {
+	struct pollfd pfd = {
+		.fd = fence,
+		.events = POLLIN,
+		.revents = 0,
+	};
+	while(true) {
+		int ret = poll(&pfd, 1, timeoutMs);
+		if(ret == -1 && errno == EINTR) continue;
+		// Anything other than a timeout means we're never getting a signal,
+		// don't hold the frame hostage over it
+		return ret != 0;
+	}
+}
+
+bool fence_wait_all(const int *fences, size_t count, int timeoutMs) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+	for(size_t i = 0; i < count; i++) {
+		int left = -1;
+		if(timeoutMs >= 0) {
+			auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			left = remaining.count() > 0 ? remaining.count() : 0;
+		}
+		if(!fence_wait(fences[i], left)) return false;
+	}
+	return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+
+// Fences are plain fds that poll readable once they've signalled. That's
+// true for both sync_files and eventfds, so an eventfd can stand in for a
+// real fence where there's no GPU.
+
+// Exports the fences a reader of the dmabuf has to wait for as a sync_file.
+// If the kernel can't do that we get an eventfd that's already signalled and
+// the implicit sync on the dmabuf is all we have. Returns -1 on failure.
+int fence_export(int dmabuf);
+
+// An eventfd fence, signalled or not
+int fence_create(bool signalled);
+void fence_signal(int fence);
+
+// Returns false if the fence didn't signal in time. A negative timeout waits
+// forever.
+bool fence_wait(int fence, int timeoutMs);
+// Same, but for all of them within the one timeout
+bool fence_wait_all(const int *fences, size_t count, int timeoutMs);
@@ -0,0 +1,15 @@
+#include "ipc.h"
+
+#include <openvr_driver.h>
+
+void pipe_fill_hello(struct PipeHello *hello) {
+	*hello = {
+		.magic = PIPE_MAGIC,
+		.version = PIPE_PROTOCOL_VERSION,
+		.driverPoseSize = sizeof(vr::DriverPose_t),
+		.eventSize = sizeof(vr::VREvent_t),
+		.submitLayerSize = sizeof(vr::IVRDriverDirectModeComponent::SubmitLayerPerEye_t),
+		.peerSlotParity = 0,
+		.caps = PIPE_CAP_FRAME_FENCE | PIPE_CAP_PRIORITY_CHANNEL,
+	};
+}
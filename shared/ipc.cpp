@@ -1,11 +1,22 @@
 #include "ipc.h"
 
 #include "log.h"
+#include "uring.h"
+
+#pragma push_macro("_WIN32")
+#pragma push_macro("WIN32")
+#undef _WIN32
+#undef WIN32
+#include "tracy/Tracy.hpp"
+#pragma pop_macro("WIN32")
+#pragma pop_macro("_WIN32")
 
 #include <cassert>
 #include <cerrno>
+#include <chrono>
 #include <cstdarg>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <mutex>
 #include <sys/stat.h>
@@ -19,23 +30,7 @@ static int removeFiles(const char *pathname, const struct stat *sbuf, int type,
 	return remove(pathname);
 }
 
-size_t Pipe::allocate_task() {
-	if(waitHead == -1) {
-		size_t id = wait.size();
-		wait.emplace_back();
-
-		return id;
-	}
-
-	size_t id = waitHead;
-	waitHead = wait[waitHead].next;
-
-	wait[waitHead].next = -1;
-
-	return id;
-}
-
-Pipe::Pipe(bool crossover, Handler handler) : waitHead(-1), handler(handler) {
+Pipe::Pipe(bool crossover, Handler handler) : handler(handler) {
 	if(crossover) {
 		log = stderr;
 
@@ -52,20 +47,30 @@ Pipe::Pipe(bool crossover, Handler handler) : waitHead(-1), handler(handler) {
 		}
 		assert(rc == 0);
 
-		write = fdopen(sock, "w");
-		read = fdopen(sock, "r");
-
 		/* read = fopen("/tmp/vrlink/forward", "rb"); */
-		setbuf(read, NULL);
 		/* assert(!unlink("/tmp/vrlink/forward")); */
 		/* write = fopen("/tmp/vrlink/backward", "wb"); */
-		setbuf(write, NULL);
 		/* assert(!unlink("/tmp/vrlink/backward")); */
+		channels[CHANNEL_NORMAL].fd = sock;
+
+		handshake(sock, false);
+
+		if(has_cap(PIPE_CAP_PRIORITY_CHANNEL)) {
+			int prio = socket(AF_UNIX, SOCK_STREAM, 0);
+			assert(prio != -1);
+			rc = connect(prio, (struct sockaddr*)&addr, sizeof(addr));
+			if(rc == -1) {
+				perror("Connecting the priority channel failed");
+			}
+			assert(rc == 0);
+			channels[CHANNEL_PRIORITY].fd = prio;
+		}
+
+		for(int i = 0; i < CHANNEL_COUNT; i++) attach_uring(&channels[i]);
 	}
 }
 
 void Pipe::_reinit(bool crossover, Handler handler) {
-	this->waitHead = -1;
 	this->handler = handler;
 	assert(!crossover);
 	if(mkdir("/tmp/vrlink", 0777) != 0) {
@@ -131,17 +136,109 @@ void Pipe::_reinit(bool crossover, Handler handler) {
 	assert(sock_conn > 0);
 	LOG(msg, "Connection!\n");
 
-	write = fdopen(sock_conn, "w");
-	read = fdopen(sock_conn, "r");
-
 	/* this->write = fopen("/tmp/vrlink/forward", "wb"); */
-	setbuf(write, NULL);
 	/* this->read = fopen("/tmp/vrlink/backward", "rb"); */
-	setbuf(read, NULL);
+	channels[CHANNEL_NORMAL].fd = sock_conn;
+
+	handshake(sock_conn, true);
+
+	if(has_cap(PIPE_CAP_PRIORITY_CHANNEL)) {
+		LOG(msg, "Accept priority channel\n");
+		int prio = accept(sock, NULL, NULL);
+		if(prio == -1) {
+			LOG(msg, "Failed to accept the priority channel\n");
+			perror("Accept failed");
+		}
+		assert(prio > 0);
+		channels[CHANNEL_PRIORITY].fd = prio;
+	}
+
+	for(int i = 0; i < CHANNEL_COUNT; i++) attach_uring(&channels[i]);
 
 	LOG(msg, "Connection established\n");
 }
 
+// Done after the handshake, that's read straight off the socket
+void Pipe::attach_uring(struct PipeChannel *channel) {
+	if(channel->fd == -1) return;
+	if(getenv("VRLINK_NO_URING") != nullptr) return;
+	if(!uring_supported()) {
+		LOG(msg, "The kernel is too old for our io_uring, using plain sockets\n");
+		return;
+	}
+
+	struct UringSender *tx = new UringSender();
+	if(!uring_sender_init(tx)) {
+		LOG(msg, "No io_uring, using plain sockets\n");
+		uring_destroy(&tx->ring);
+		delete tx;
+		return;
+	}
+	channel->tx = tx;
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+	const uint8_t *p = (const uint8_t*)buf;
+	while(len > 0) {
+		ssize_t ret = ::write(fd, p, len);
+		if(ret == -1 && errno == EINTR) continue;
+		if(ret <= 0) {
+			perror("Handshake write failed");
+			abort();
+		}
+		p += ret;
+		len -= ret;
+	}
+}
+
+static void read_all(int fd, void *buf, size_t len) {
+	uint8_t *p = (uint8_t*)buf;
+	while(len > 0) {
+		ssize_t ret = ::read(fd, p, len);
+		if(ret == -1 && errno == EINTR) continue;
+		if(ret <= 0) {
+			perror("Handshake read failed");
+			abort();
+		}
+		p += ret;
+		len -= ret;
+	}
+}
+
+// Both sides say hello before anything else goes over the socket. Nothing
+// is exchanged until the two agree on the protocol and the layout of the
+// structs we copy around raw.
+void Pipe::handshake(int sock, bool listener) {
+	struct PipeHello local;
+	pipe_fill_hello(&local);
+	// We take the even slots, the other side gets the odd ones
+	local.peerSlotParity = listener ? 1 : 0;
+	write_all(sock, &local, sizeof(local));
+
+	struct PipeHello remote;
+	read_all(sock, &remote, sizeof(remote));
+
+	if(remote.magic != PIPE_MAGIC) {
+		msg("Handshake failed: the other end isn't speaking our protocol (magic %08x)\n", remote.magic);
+		abort();
+	}
+	if(remote.version != local.version) {
+		msg("Handshake failed: protocol version %u, we speak %u\n", remote.version, local.version);
+		abort();
+	}
+	if(remote.driverPoseSize != local.driverPoseSize || remote.eventSize != local.eventSize || remote.submitLayerSize != local.submitLayerSize) {
+		msg("Handshake failed: struct sizes differ. DriverPose_t %u/%u, VREvent_t %u/%u, SubmitLayerPerEye_t %u/%u\n",
+				local.driverPoseSize, remote.driverPoseSize,
+				local.eventSize, remote.eventSize,
+				local.submitLayerSize, remote.submitLayerSize);
+		abort();
+	}
+
+	slotParity = listener ? 0 : remote.peerSlotParity;
+	caps = local.caps & remote.caps;
+	msg("Handshake done, protocol %u, caps %lx (ours %lx, theirs %lx)\n", local.version, caps, local.caps, remote.caps);
+}
+
 void Pipe::msg(const char *format, ...) {
 	va_list argptr;
 	va_start(argptr, format);
@@ -154,223 +251,815 @@ struct HandlerArgs {
 	Pipe *pipe;
 	struct Thread *thread;
 	void *userdata;
-	std::thread::id remoteId;
+	uint32_t remoteSlot;
 };
 
-thread_local std::thread::id shared_thread;
+thread_local uint32_t shared_slot = NoSlot;
+// Set on the threads running a dispatcher. If an inline handler calls the
+// other side, that thread has to keep dispatching its channel while it
+// waits.
+thread_local struct PipeChannel *dispatching = nullptr;
+// The channels this thread is currently writing to and reading from
+thread_local struct PipeChannel *out_channel = nullptr;
+thread_local struct PipeChannel *in_channel = nullptr;
+// Set instead of in_channel when we're reading a queued message
+thread_local struct PipeMessage *in_message = nullptr;
+thread_local uint64_t in_task;
+// Where the call being handled came from, its return goes back there
+thread_local struct PipeChannel *call_channel = nullptr;
+thread_local bool call_detached = false;
+// How many handlers deep the logical thread is, counting both sides
+thread_local uint32_t handler_depth = 0;
+// The last call this thread made
+thread_local uint64_t outgoing_call;
+
+#ifdef TRACY_ENABLE
+// What we tag zones with. Search for the same text in the other process
+static size_t call_text(char *buf, size_t len, uint32_t slot, uint64_t task, uint64_t frame) {
+	int ret = snprintf(buf, len, "slot %u task %lu frame %lu", slot, task, frame);
+	return ret < 0 ? 0 : ret;
+}
+#endif
+
+// Whether a parked thread takes the message. A call is only taken if it was
+// made by something handling our wait, otherwise it's a new call from the
+// other side that has to wait its turn. Can't be both, the other side runs
+// a slot's calls one after the other.
+static bool wants(struct Thread *thread, enum PipeMethod method, uint64_t task, uint32_t depth) {
+	if(method == METH_PROTO_RET) return task == thread->waitTask;
+	return depth >= thread->waitDepth;
+}
+
+// Lets go of the channel or the queued message we've been reading
+static void done_reading() {
+	if(in_message != nullptr) {
+		assert(in_message->pos == in_message->data.size());
+		delete in_message;
+		in_message = nullptr;
+		return;
+	}
+	// Anything left over means the two sides disagree on the arguments
+	assert(in_channel->inRemaining == 0);
+	in_channel->readLock.unlock();
+}
 
-static void executeTask(Pipe *pipe, struct Thread *thread, void *userdata) {
+static void executeTask(Pipe *pipe, struct Thread *thread, void *userdata, uint64_t waitTask) {
 	while(true) {
+		enum PipeMethod method;
+		uint8_t flags;
+		uint64_t task;
+		[[maybe_unused]] uint64_t frame;
+		uint32_t depth;
 		{
 			std::unique_lock taskLock(*thread->lock);
-			LOG(pipe->msg, "Parking thread %d\n", std::this_thread::get_id());
-			thread->cond->wait(taskLock, [&] { return thread->pending; });
-			// Take the task. we can buffer a new one
-			thread->pending = false;
+			LOG(pipe->msg, "Parking thread %d\n", shared_slot);
+			thread->waitTask = waitTask;
+			thread->waitDepth = handler_depth;
+			auto next = thread->queue.end();
+			thread->waiting = true;
+			thread->cond->wait(taskLock, [&] {
+				if(thread->pending) return true;
+				for(next = thread->queue.begin(); next != thread->queue.end(); next++) {
+					if(wants(thread, (*next)->method, (*next)->task, (*next)->depth)) return true;
+				}
+				return false;
+			});
+			thread->waiting = false;
+
+			if(thread->pending) {
+				// Take the task. we can buffer a new one
+				thread->pending = false;
+				method = thread->method;
+				flags = thread->flags;
+				task = thread->task;
+				frame = thread->frame;
+				depth = thread->depth;
+				in_channel = pipe->get_channel(thread->channel);
+				in_message = nullptr;
+			} else {
+				in_message = next->release();
+				thread->queue.erase(next);
+				method = in_message->method;
+				flags = in_message->flags;
+				task = in_message->task;
+				frame = in_message->frame;
+				depth = in_message->depth;
+				in_channel = pipe->get_channel(in_message->channel);
+			}
 		}
-		LOG(pipe->msg, "Got task %d\n", thread->method);
+		LOG(pipe->msg, "Got task %d\n", method);
+		in_task = task;
 
-		if(thread->method == METH_PROTO_RET) break;
+		if(method == METH_PROTO_RET) {
+			assert(task == waitTask);
+			break;
+		}
 
-		pipe->handler(thread->method, userdata);
-		LOG(pipe->msg, "Done handling %d\n", thread->method);
+		struct PipeChannel *parentChannel = call_channel;
+		bool parentDetached = call_detached;
+		uint32_t parentDepth = handler_depth;
+		call_channel = in_channel;
+		call_detached = flags & PIPE_MSG_DETACHED;
+		handler_depth = depth + 1;
+		{
+			ZoneScopedN("Handle");
+#ifdef TRACY_ENABLE
+			char text[64];
+			ZoneText(text, call_text(text, sizeof(text), shared_slot, task, frame));
+#endif
+			pipe->handler(method, userdata);
+		}
+		// The dispatcher counted it when it came in
+		thread->busy--;
+		LOG(pipe->msg, "Done handling %d\n", method);
 		// The handler will have taken the write lock to return some
-		// values. We need to unlock it again
-		pipe->writeLock.unlock();
+		// values. Send them and let go of it again
+		pipe->end_return();
+		call_channel = parentChannel;
+		call_detached = parentDetached;
+		handler_depth = parentDepth;
 	}
 }
 
 static void InternalHandler(void *userdata) {
 	struct HandlerArgs *args = (struct HandlerArgs*)userdata;
-	shared_thread = args->remoteId;
+	shared_slot = args->remoteSlot;
 
-	executeTask(args->pipe, args->thread, args->userdata);
+	executeTask(args->pipe, args->thread, args->userdata, UINT64_MAX);
 
 	LOG(args->pipe->msg, "ERR: Return from Root Task. That's not supposed to happen\n");
 	abort();
 }
 
-static struct Thread* lookupThreadData(Pipe *pipe, std::map<std::thread::id, struct Thread> *threads, std::thread::id remoteId, void *userdata, bool adopt) {
-	auto [it, inserted] = threads->try_emplace(remoteId);
-	struct Thread *thread;
-	if(inserted) {
-		if(!adopt) {
-			LOG(pipe->msg, "No existing thread for %d, creating one\n", remoteId);
-			thread = &it->second;
-			struct HandlerArgs *args = (struct HandlerArgs*)malloc(sizeof(struct HandlerArgs));
-			args->pipe = pipe;
-			args->thread = thread;
-			args->userdata = userdata;
-			args->remoteId = remoteId;
-			thread->thread = shim::thread(&InternalHandler, args);
-		} else {
-			LOG(pipe->msg, "Adopting current thread as %d\n", remoteId);
-			thread = &it->second;
-		}
+struct Thread *Pipe::lookup_thread(uint32_t slot, void *userdata, bool adopt) {
+	std::unique_lock lock(threadsLock);
+	if(slot >= threads.size()) {
+		threads.resize(slot + 1);
+	}
+
+	struct Thread *thread = threads[slot].get();
+	if(thread != nullptr) {
+		assert(!adopt || slot == shared_slot);
+		return thread;
+	}
+
+	threads[slot] = std::make_unique<struct Thread>();
+	thread = threads[slot].get();
+	if(!adopt) {
+		LOG(msg, "No existing thread for %d, creating one\n", slot);
+		struct HandlerArgs *args = (struct HandlerArgs*)malloc(sizeof(struct HandlerArgs));
+		args->pipe = this;
+		args->thread = thread;
+		args->userdata = userdata;
+		args->remoteSlot = slot;
+		thread->thread = shim::thread(&InternalHandler, args);
 	} else {
-		LOG(pipe->msg, "Using existing thread\n");
-		thread = &threads->at(remoteId);
-		assert(!adopt || remoteId == std::this_thread::get_id());
+		LOG(msg, "Adopting current thread as %d\n", slot);
 	}
 
 	return thread;
 }
 
-void Pipe::dispatch_requests(void* userdata) {
+struct Thread *Pipe::find_thread(uint32_t slot) {
+	std::unique_lock lock(threadsLock);
+	if(slot >= threads.size()) return nullptr;
+	return threads[slot].get();
+}
+
+// Handlers that are cheap and never call the other side run right on the
+// dispatcher. That saves waking a worker and switching back for most of the
+// traffic. Anything that can call back keeps its own logical thread, and so
+// does anything resolving a promise, since that can wait on another slot.
+static enum PipeExec exec_policy(enum PipeMethod method) {
+	switch(method) {
+	// Served by the native side
+	case METH_LOG:
+	case METH_SETS_GBOOL:
+	case METH_SETS_GINT:
+	case METH_SETS_GFLT:
+	case METH_SETS_GSTR:
+	case METH_PATH_S2H:
+	case METH_PROP_READ:
+	case METH_PROP_TRANS:
+	case METH_SERVER_POSE:
+	case METH_SERVER_VSYNC:
+	// Served by the dllhost. The driver might read a setting in these, the
+	// nested dispatch takes care of that.
+	case METH_COMP_DISTORTION:
+	case METH_COMP_TARGETSIZE:
+	case METH_COMP_PROJRAW:
+	case METH_COMP_WINSIZE:
+	case METH_COMP_EYEVIEWPORT:
+	case METH_COMP_ONDESKTOP:
+	case METH_COMP_REALDISPLAY:
+		return PIPE_EXEC_INLINE;
+	default:
+		return PIPE_EXEC_THREAD;
+	}
+}
+
+// Frame critical methods get the priority channel. That's everything
+// direct mode does on a frame and the pose updates.
+struct PipeChannel *Pipe::channel_for(enum PipeMethod method) {
+	if(channels[CHANNEL_PRIORITY].fd == -1) return &channels[CHANNEL_NORMAL];
+
+	switch(method) {
+	case METH_DIRECT_NEXT:
+	case METH_DIRECT_FRAME:
+	case METH_SERVER_POSE:
+	case METH_SERVER_VSYNC:
+		return &channels[CHANNEL_PRIORITY];
+	default:
+		return &channels[CHANNEL_NORMAL];
+	}
+}
+
+// Reads one message off the channel and runs it or hands it to its worker.
+// Returns true if it's the return waitSlot is waiting for, the caller then
+// owns the read channel.
+bool Pipe::dispatch_one(struct PipeChannel *channel, void *userdata, uint32_t waitSlot) {
+	std::unique_lock chanLock(channel->readLock);
+	LOG(msg, "Waiting for next\n");
+	assert(channel->inRemaining == 0);
+
 	enum PipeMethod method;
-	while(true) {
-		std::unique_lock chanLock(readLock);
-		LOG(msg, "Waiting for next\n");
-		recv(&method, sizeof(enum PipeMethod));
-		LOG(msg, "DBG METHOD %d\n", method);
+	uint8_t flags;
+	read_raw(channel, &method, sizeof(method));
+	read_raw(channel, &flags, sizeof(flags));
+	uint32_t slot = read_varint(channel);
+	uint64_t task = read_varint(channel);
+	uint64_t remoteFrame = read_varint(channel);
+	uint32_t depth = read_varint(channel);
+	channel->inFdCount = read_varint(channel);
+	channel->inRemaining = read_varint(channel);
+	// Only the native side counts frames, we just follow along
+	if(remoteFrame > frame) frame = remoteFrame;
 
-		std::thread::id remoteId;
-		recv(&remoteId, sizeof(std::thread::id));
+	LOG(msg, "Incoming call %d on %d, %lu bytes\n", method, slot, channel->inRemaining);
 
-		LOG(msg, "Incoming call %d on %d\n", method, remoteId);
+	if(slot == waitSlot && method == METH_PROTO_RET) {
+		chanLock.release();
+		in_channel = channel;
+		in_message = nullptr;
+		in_task = task;
+		return true;
+	}
 
-		struct Thread *thread = lookupThreadData(this, &threads, remoteId, userdata, false);
+	// While we wait on the dispatcher everything on our slot is for us.
+	// Other slots go to their workers then, or we'd end up waiting on two
+	// slots at once and could only take the returns in one order. A slot
+	// with a worker that's in the middle of something has to go to the
+	// worker too, it might be holding locks the handler needs.
+	bool runInline = slot == waitSlot;
+	if(waitSlot == NoSlot && exec_policy(method) == PIPE_EXEC_INLINE) {
+		struct Thread *thread = find_thread(slot);
+		runInline = thread == nullptr || thread->busy == 0;
+	}
 
-		std::unique_lock taskLock(*thread->lock);
-		assert(thread->pending == false);
-		thread->method = method;
-		thread->pending = true;
-		// Wake up the thread. The thread now owns the readLock.
-		thread->cond->notify_all();
+	if(runInline) {
+		ZoneScopedN("HandleInline");
+#ifdef TRACY_ENABLE
+		char text[64];
+		ZoneText(text, call_text(text, sizeof(text), slot, task, remoteFrame));
+#endif
+		// The handler gives up the read channel when it's done reading
 		chanLock.release();
+		uint32_t prevSlot = shared_slot;
+		struct PipeChannel *prevCall = call_channel;
+		bool prevDetached = call_detached;
+		uint32_t prevDepth = handler_depth;
+		shared_slot = slot;
+		in_channel = channel;
+		in_message = nullptr;
+		in_task = task;
+		call_channel = channel;
+		call_detached = flags & PIPE_MSG_DETACHED;
+		handler_depth = depth + 1;
+		handler(method, userdata);
+		end_return();
+		shared_slot = prevSlot;
+		call_channel = prevCall;
+		call_detached = prevDetached;
+		handler_depth = prevDepth;
+		return false;
+	}
+
+	struct Thread *thread = lookup_thread(slot, userdata, false);
+
+	{
+		std::unique_lock taskLock(*thread->lock);
+		if(method != METH_PROTO_RET) thread->busy++;
+		if(thread->waiting && !thread->pending && thread->queue.empty() && wants(thread, method, task, depth)) {
+			thread->method = method;
+			thread->flags = flags;
+			thread->task = task;
+			thread->frame = remoteFrame;
+			thread->depth = depth;
+			thread->channel = channel - channels;
+			thread->pending = true;
+			// Wake up the thread. The thread now owns the readLock.
+			thread->cond->notify_all();
+			chanLock.release();
+			return false;
+		}
+	}
+
+	// It's busy or waiting for something else. Take the message off the
+	// channel so the other slots can go on.
+	ZoneScopedN("QueueMessage");
+	struct PipeMessage *message = read_message(channel, method, flags, depth, task, remoteFrame);
+	chanLock.unlock();
+
+	std::unique_lock taskLock(*thread->lock);
+	thread->queue.emplace_back(message);
+	thread->cond->notify_all();
+	return false;
+}
+
+struct PipeMessage *Pipe::read_message(struct PipeChannel *channel, enum PipeMethod method, uint8_t flags, uint32_t depth, uint64_t task, uint64_t frame) {
+	struct PipeMessage *message = new PipeMessage();
+	message->method = method;
+	message->flags = flags;
+	message->channel = channel - channels;
+	message->depth = depth;
+	message->task = task;
+	message->frame = frame;
+
+	message->data.resize(channel->inRemaining);
+	read_raw(channel, message->data.data(), channel->inRemaining);
+	channel->inRemaining = 0;
+
+	for(uint64_t i = 0; i < channel->inFdCount; i++) {
+		assert(channel->inFdPos < channel->inFds.size());
+		message->fds.push_back(channel->inFds[channel->inFdPos++]);
+	}
+	return message;
+}
+
+struct DispatchArgs {
+	Pipe *pipe;
+	struct PipeChannel *channel;
+	void *userdata;
+};
+
+void Pipe::dispatch_channel(void *args_) {
+	struct DispatchArgs *args = (struct DispatchArgs*)args_;
+	dispatching = args->channel;
+	while(true) {
+		args->pipe->dispatch_one(args->channel, args->userdata, NoSlot);
 	}
 }
 
+void Pipe::dispatch_requests(void* userdata) {
+	dispatchUserdata = userdata;
+
+	// The priority channel gets a dispatcher of its own
+	if(channels[CHANNEL_PRIORITY].fd != -1) {
+		struct DispatchArgs *args = (struct DispatchArgs*)malloc(sizeof(struct DispatchArgs));
+		args->pipe = this;
+		args->channel = &channels[CHANNEL_PRIORITY];
+		args->userdata = userdata;
+		shim::thread(&dispatch_channel, args);
+	}
+
+	struct DispatchArgs args = {
+		.pipe = this,
+		.channel = &channels[CHANNEL_NORMAL],
+		.userdata = userdata,
+	};
+	dispatch_channel(&args);
+}
+
 size_t Pipe::complete_reading_args() {
 	LOG(msg, "Done reading args\n");
-	size_t taskId;
-	recv(&taskId, sizeof(uint64_t));
-	readLock.unlock();
+	size_t taskId = in_task;
+	done_reading();
 	return taskId;
 }
 
-static const enum PipeMethod retValue = METH_PROTO_RET;
 void Pipe::return_from_call(size_t taskId) {
 	LOG(msg, "Taking write lock to return %d\n", taskId);
-	writeLock.lock();
+	out_channel = call_channel;
+	out_channel->writeLock.lock();
 	LOG(msg, "Returning to %d\n", taskId);
-	send(&retValue, sizeof(enum PipeMethod));
-	send(&shared_thread, sizeof(shared_thread));
+	out_channel->outMethod = METH_PROTO_RET;
+	out_channel->outFlags = 0;
+	out_channel->outSlot = shared_slot;
+	out_channel->outTask = taskId;
+	out_channel->outDepth = handler_depth;
+	out_channel->outDiscard = call_detached;
+}
+
+void Pipe::end_return() {
+	flush(out_channel);
+	out_channel->writeLock.unlock();
 }
 
 void Pipe::begin_call(enum PipeMethod method) {
 	LOG(msg, "Call remote %d\n", method);
-	writeLock.lock();
-	send(&method, sizeof(enum PipeMethod));
+	// Calls made while handling one stay on its channel, the other side
+	// might be waiting on that channel's dispatcher
+	if(dispatching != nullptr) {
+		out_channel = dispatching;
+	} else if(call_channel != nullptr) {
+		out_channel = call_channel;
+	} else {
+		out_channel = channel_for(method);
+	}
+	out_channel->writeLock.lock();
 
-	// A thread spawned outside of our code is assigned an ID here
-	if(shared_thread == std::thread::id()) {
-		shared_thread = std::this_thread::get_id();
-		struct Thread *thread = lookupThreadData(this, &threads, shared_thread, NULL, true);
+	// A thread spawned outside of our code is assigned a slot here
+	if(shared_slot == NoSlot) {
+		shared_slot = nextSlot++ * 2 + slotParity;
+		struct Thread *thread = lookup_thread(shared_slot, NULL, true);
 		thread->method = method;
 	}
+	// Anything calling back on this slot has to wait for us. The dispatcher
+	// borrows remote slots and there's no worker to mark.
+	if(dispatching == nullptr) {
+		lookup_thread(shared_slot, NULL, true)->busy++;
+	}
 
-	send(&shared_thread, sizeof(shared_thread));
+	out_channel->outMethod = method;
+	out_channel->outFlags = 0;
+	out_channel->outSlot = shared_slot;
+	out_channel->outTask = outgoing_call = nextTask++;
+	out_channel->outDepth = handler_depth;
+	out_channel->outDiscard = false;
 }
 
 void Pipe::wait_for_return() {
 	LOG(msg, "Waiting for message return\n");
-	size_t taskId = allocate_task();
-
-	// Send the taskid to the remote end such that it knows who to return to
-	send(&taskId, sizeof(uint64_t));
+	if(dispatching == nullptr) {
+		wait_for(send_async());
+		return;
+	}
 
-	fflush(write);
+	flush(out_channel);
 	// We no longer intend to write anything
-	writeLock.unlock();
-
-	struct Thread *thread = lookupThreadData(this, &threads, shared_thread, NULL, false);
-	LOG(msg, "Wait for return of %d\n", taskId);
-	executeTask(this, thread, NULL);
+	out_channel->writeLock.unlock();
 
-	LOG(msg, "Wakeup %d\n", taskId);
+	ZoneScopedN("WaitForReturn");
+#ifdef TRACY_ENABLE
+	char text[64];
+	ZoneText(text, call_text(text, sizeof(text), shared_slot, outgoing_call, frame));
+#endif
+	// We're an inline handler, nobody else is reading this channel
+	while(!dispatch_one(dispatching, dispatchUserdata, shared_slot));
+	LOG(msg, "Wakeup %d\n", outgoing_call);
 }
 
 void Pipe::return_read_channel() {
 	LOG(msg, "Done reading return values\n");
-	readLock.unlock();
+	done_reading();
 }
 
-void Pipe::send(const void *buf, size_t len) {
-	if(fwrite(buf, 1, len, write) != len) {
-		LOG(msg, "Write denied\n");
-		abort();
+struct PipeFuture Pipe::send_async() {
+	// The dispatcher can only take the return of the last call it made
+	assert(dispatching == nullptr);
+	flush(out_channel);
+	out_channel->writeLock.unlock();
+	return { .slot = shared_slot, .task = outgoing_call };
+}
+
+void Pipe::wait_for(struct PipeFuture future) {
+	assert(future.slot == shared_slot);
+	LOG(msg, "Wait for return of %d\n", future.task);
+	ZoneScopedN("WaitForReturn");
+#ifdef TRACY_ENABLE
+	char text[64];
+	ZoneText(text, call_text(text, sizeof(text), future.slot, future.task, frame));
+#endif
+	struct Thread *thread = lookup_thread(shared_slot, NULL, false);
+	executeTask(this, thread, NULL, future.task);
+	thread->busy--;
+	LOG(msg, "Wakeup %d\n", future.task);
+}
+
+void Pipe::send_detached() {
+	out_channel->outFlags |= PIPE_MSG_DETACHED;
+	flush(out_channel);
+	out_channel->writeLock.unlock();
+	// There's nothing to wait for
+	if(dispatching == nullptr) {
+		lookup_thread(shared_slot, NULL, false)->busy--;
+	}
+}
+
+void Pipe::fulfill(uint64_t promise, uint64_t value, uint64_t owner) {
+	if(!(promise & PIPE_PROMISE_BIT)) return;
+	{
+		std::unique_lock lock(promisesLock);
+		promises[promise] = value;
+		// The driver keeps the first promise it got for a handle
+		promisedValues.emplace(value, promise);
+		promiseOwners.emplace(owner ? owner : value, promise);
 	}
+	promisesCond.notify_all();
+}
+
+void Pipe::reject(uint64_t promise, uint64_t invalid, uint64_t owner) {
+	if(!(promise & PIPE_PROMISE_BIT)) return;
+	{
+		std::unique_lock lock(promisesLock);
+		// Nothing maps back to the invalid handle
+		promises[promise] = invalid;
+		if(owner) promiseOwners.emplace(owner, promise);
+	}
+	promisesCond.notify_all();
+}
+
+uint64_t Pipe::resolve(uint64_t handle, uint64_t invalid) {
+	if(!(handle & PIPE_PROMISE_BIT)) return handle;
+
+	std::unique_lock lock(promisesLock);
+	// The call making it went out first, but if the promise was handed to
+	// another thread that call might still be queued on its own slot
+	bool found = promisesCond.wait_for(lock, std::chrono::seconds(10), [&] {
+		return promises.count(handle) != 0;
+	});
+	if(!found) {
+		// Either the call got lost or the handle was forgotten. The caller
+		// gets the invalid handle, same as a rejected promise.
+		msg("Promise %lx was never fulfilled\n", handle & ~PIPE_PROMISE_BIT);
+		return invalid;
+	}
+	return promises[handle];
+}
+
+void Pipe::forget(uint64_t value) {
+	std::unique_lock lock(promisesLock);
+	auto range = promiseOwners.equal_range(value);
+	for(auto it = range.first; it != range.second; it++) {
+		auto promise = promises.find(it->second);
+		if(promise == promises.end()) continue;
+		auto back = promisedValues.find(promise->second);
+		if(back != promisedValues.end() && back->second == it->second) {
+			promisedValues.erase(back);
+		}
+		promises.erase(promise);
+	}
+	promiseOwners.erase(range.first, range.second);
+}
+
+uint64_t Pipe::promise_of(uint64_t value) {
+	std::unique_lock lock(promisesLock);
+	auto it = promisedValues.find(value);
+	return it == promisedValues.end() ? value : it->second;
+}
+
+void Pipe::send(const void *buf, size_t len) {
+	const uint8_t *bytes = (const uint8_t*)buf;
+	out_channel->out.insert(out_channel->out.end(), bytes, bytes + len);
 }
 
 void Pipe::recv(void *buf, size_t max_len) {
-	if(fread(buf, 1, max_len, read) != max_len) {
-		LOG(msg, "Read denied\n");
+	if(in_message != nullptr) {
+		if(max_len > in_message->data.size() - in_message->pos) {
+			LOG(msg, "Read past the end of the message\n");
+			abort();
+		}
+		memcpy(buf, in_message->data.data() + in_message->pos, max_len);
+		in_message->pos += max_len;
+		return;
+	}
+	if(max_len > in_channel->inRemaining) {
+		LOG(msg, "Read past the end of the message\n");
 		abort();
 	}
+	in_channel->inRemaining -= max_len;
+	read_raw(in_channel, buf, max_len);
 }
 
-void Pipe::send_new_obj(void *obj) {
-	size_t handle = objs.size() + 1;
-	objs.push_back(obj);
-	send(&handle, sizeof(uint64_t));
+static size_t encode_varint(uint8_t *buf, uint64_t value) {
+	size_t len = 0;
+	do {
+		uint8_t byte = value & 0x7F;
+		value >>= 7;
+		if(value != 0) byte |= 0x80;
+		buf[len++] = byte;
+	} while(value != 0);
+	return len;
 }
 
-void Pipe::send_fd(int fd) {
-	char data = 'x';
-    struct iovec iov = {
-		.iov_base = &data,
-		.iov_len = 1,
+void Pipe::send_varint(uint64_t value) {
+	uint8_t buf[10];
+	send(buf, encode_varint(buf, value));
+}
+
+uint64_t Pipe::recv_varint() {
+	uint64_t value = 0;
+	for(unsigned shift = 0; shift < 64; shift += 7) {
+		uint8_t byte;
+		recv(&byte, sizeof(byte));
+		value |= (uint64_t)(byte & 0x7F) << shift;
+		if(!(byte & 0x80)) return value;
+	}
+	LOG(msg, "Varint too long\n");
+	abort();
+}
+
+// Sends the header and payload in one go with any fds attached
+void Pipe::flush(struct PipeChannel *channel) {
+	if(channel->outDiscard) {
+		channel->out.clear();
+		channel->outFds.clear();
+		// The handler might have left some detached calls behind
+		if(channel->tx != nullptr && !uring_sender_flush(channel->tx)) {
+			LOG(this->msg, "Write denied\n");
+			abort();
+		}
+		return;
+	}
+
+	uint8_t header[MaxHeaderSize];
+	size_t headerLen = 0;
+	header[headerLen++] = channel->outMethod;
+	header[headerLen++] = channel->outFlags;
+	headerLen += encode_varint(header + headerLen, channel->outSlot);
+	headerLen += encode_varint(header + headerLen, channel->outTask);
+	headerLen += encode_varint(header + headerLen, frame);
+	headerLen += encode_varint(header + headerLen, channel->outDepth);
+	headerLen += encode_varint(header + headerLen, channel->outFds.size());
+	headerLen += encode_varint(header + headerLen, channel->out.size());
+
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = headerLen },
+		{ .iov_base = channel->out.data(), .iov_len = channel->out.size() },
 	};
-	char control[CMSG_SPACE(sizeof (int))] = {0};
-    struct msghdr msg = {
+	char control[CMSG_SPACE(sizeof(int) * MaxMessageFds)] = {0};
+	struct msghdr msg = {
 		.msg_name = NULL,
 		.msg_namelen = 0,
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-
-		.msg_control = control,
-		.msg_controllen = sizeof(control),
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+		.msg_control = NULL,
+		.msg_controllen = 0,
 	};
 
+	std::vector<int> &fds = channel->outFds;
+	assert(fds.size() <= MaxMessageFds);
+	// Detached calls from a handler can wait for its return, it goes out on
+	// the same channel. Anything else goes out right away, with whatever is
+	// waiting ahead of it.
+	bool batch = (channel->outFlags & PIPE_MSG_DETACHED) && fds.empty() && channel == call_channel;
+	struct UringSender *tx = channel->tx;
+	if(tx != nullptr && (batch || tx->queued > 0) && flush_uring(channel, iov, 2, batch)) {
+		channel->out.clear();
+		fds.clear();
+		return;
+	}
+	if(!fds.empty()) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+	}
 
-	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_len = CMSG_LEN(sizeof (int));
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
+	// The socket is blocking so this only comes up short if a signal hits
+	// us halfway through a big message
+	size_t total = headerLen + channel->out.size();
+	size_t sent = 0;
+	while(sent < total) {
+		ssize_t ret = sendmsg(channel->fd, &msg, MSG_NOSIGNAL);
+		if(ret == -1) {
+			if(errno == EINTR) continue;
+			LOG(this->msg, "Write denied\n");
+			abort();
+		}
+		sent += ret;
 
-	*((int *) CMSG_DATA(cmsg)) = fd;
+		// The fds went out with the first bytes
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		while(ret > 0 && msg.msg_iovlen > 0) {
+			if((size_t)ret < msg.msg_iov->iov_len) {
+				msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + ret;
+				msg.msg_iov->iov_len -= ret;
+				ret = 0;
+			} else {
+				ret -= msg.msg_iov->iov_len;
+				msg.msg_iov++;
+				msg.msg_iovlen--;
+			}
+		}
+	}
 
-    size_t size = sendmsg(fileno(this->write), &msg, 0);
-	assert(size == 1);
+	channel->out.clear();
+	fds.clear();
 }
 
-void Pipe::recv_fd(int *fd) {
-	char data;
-    struct iovec iov = {
-		.iov_base = &data,
-		.iov_len = 1,
+// Returns false if the message is too big for the send buffer, everything
+// before it has gone out by then
+bool Pipe::flush_uring(struct PipeChannel *channel, struct iovec *iov, int iovCount, bool batch) {
+	struct UringSender *tx = channel->tx;
+	std::vector<int> &fds = channel->outFds;
+	if(!uring_sender_queue(tx, channel->fd, iov, iovCount, fds.data(), fds.size())) {
+		if(!uring_sender_flush(tx)) {
+			LOG(this->msg, "Write denied\n");
+			abort();
+		}
+		if(!uring_sender_queue(tx, channel->fd, iov, iovCount, fds.data(), fds.size())) return false;
+	}
+
+	if(!batch && !uring_sender_flush(tx)) {
+		LOG(this->msg, "Write denied\n");
+		abort();
+	}
+	return true;
+}
+
+void Pipe::fill(struct PipeChannel *channel) {
+	if(channel->rbuf.empty()) channel->rbuf.resize(64 * 1024);
+
+	struct iovec iov = {
+		.iov_base = channel->rbuf.data(),
+		.iov_len = channel->rbuf.size(),
 	};
-	char control[CMSG_SPACE(sizeof (int))] = {0};
-    struct msghdr msg = {
+	char control[CMSG_SPACE(sizeof(int) * MaxMessageFds)] = {0};
+	struct msghdr msg = {
 		.msg_name = NULL,
 		.msg_namelen = 0,
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
-
 		.msg_control = control,
 		.msg_controllen = sizeof(control),
 	};
 
+	ssize_t size;
+	do {
+		size = recvmsg(channel->fd, &msg, MSG_CMSG_CLOEXEC);
+	} while(size == -1 && errno == EINTR);
+	if(size <= 0) {
+		LOG(this->msg, "Read denied\n");
+		abort();
+	}
+	assert(!(msg.msg_flags & MSG_CTRUNC));
+	channel->rpos = 0;
+	channel->rlen = size;
+
+	// The kernel never hands us fds from two messages in one read, and they
+	// are consumed in the order they were sent
+	if(channel->inFdPos == channel->inFds.size()) {
+		channel->inFds.clear();
+		channel->inFdPos = 0;
+	}
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *fds = (int*)CMSG_DATA(cmsg);
+		channel->inFds.insert(channel->inFds.end(), fds, fds + count);
+	}
+}
+
+void Pipe::read_raw(struct PipeChannel *channel, void *buf, size_t len) {
+	uint8_t *dst = (uint8_t*)buf;
+	while(len > 0) {
+		if(channel->rpos == channel->rlen) fill(channel);
+		size_t n = channel->rlen - channel->rpos < len ? channel->rlen - channel->rpos : len;
+		memcpy(dst, channel->rbuf.data() + channel->rpos, n);
+		channel->rpos += n;
+		dst += n;
+		len -= n;
+	}
+}
+
+uint64_t Pipe::read_varint(struct PipeChannel *channel) {
+	uint64_t value = 0;
+	for(unsigned shift = 0; shift < 64; shift += 7) {
+		uint8_t byte;
+		read_raw(channel, &byte, sizeof(byte));
+		value |= (uint64_t)(byte & 0x7F) << shift;
+		if(!(byte & 0x80)) return value;
+	}
+	LOG(msg, "Varint too long\n");
+	abort();
+}
 
-    size_t size = recvmsg(fileno(this->read), &msg, 0);
-	assert(size == 1);
+void Pipe::send_new_obj(void *obj) {
+	size_t handle = objs.size() + 1;
+	objs.push_back(obj);
+	send_handle(handle);
+}
 
-	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-	assert(cmsg != nullptr);
-	assert(cmsg->cmsg_len == CMSG_LEN(sizeof (int)));
-	assert(cmsg->cmsg_level == SOL_SOCKET);
-	assert(cmsg->cmsg_type == SCM_RIGHTS);
+// The kernel only dups the fd when the message is flushed, so keep it open
+// until then
+void Pipe::send_fd(int fd) {
+	ZoneScoped;
+	out_channel->outFds.push_back(fd);
+}
 
-	*fd  = *((int *) CMSG_DATA(cmsg));
+void Pipe::recv_fd(int *fd) {
+	ZoneScoped;
+	if(in_message != nullptr) {
+		assert(in_message->fdPos < in_message->fds.size());
+		*fd = in_message->fds[in_message->fdPos++];
+		return;
+	}
+	// It came in with the first bytes of the message
+	assert(in_channel->inFdPos < in_channel->inFds.size());
+	*fd = in_channel->inFds[in_channel->inFdPos++];
 }
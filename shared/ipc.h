@@ -1,9 +1,12 @@
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <deque>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <vector>
 #include <thread>
@@ -42,6 +45,7 @@ enum PipeMethod : uint8_t {
 	METH_SERVER_PROJ,
 
 	METH_DEV_ACTIVATE,
+	METH_DEV_DEACTIVATE,
 	METH_DEV_COMPONENT,
 
 	METH_COMP_DISTORTION,
@@ -54,10 +58,10 @@ enum PipeMethod : uint8_t {
 
 	METH_DIRECT_CSWAP,
 	METH_DIRECT_NEXT,
-	METH_DIRECT_SUBMIT,
-	METH_DIRECT_PRESENT,
-	METH_DIRECT_POSTPRES,
-	METH_DIRECT_FTIME,
+	METH_DIRECT_FRAME,
+	METH_DIRECT_FTIMESLOT,
+	METH_DIRECT_DSWAP,
+	METH_DIRECT_DSWAPALL,
 
 	METH_INPUT_CBOOL,
 	METH_INPUT_UBOOL,
@@ -75,17 +79,98 @@ enum PipeMethod : uint8_t {
 
 typedef void (*Handler)(enum PipeMethod, void* userdata);
 
-struct WaitSlot {
-	ssize_t next = -1;
-	std::unique_ptr<std::mutex> lock = std::make_unique<std::mutex>();
-	std::unique_ptr<std::condition_variable> cond = std::make_unique<std::condition_variable>();
-	bool triggered = false;
+// Logical threads are named by a small slot number instead of a thread id.
+// Each side hands out slots of its own parity, which is settled when the
+// connection is made.
+static const uint32_t NoSlot = UINT32_MAX;
+
+// A message is a header followed by the payload:
+//   method, flags (1 byte each)
+//   slot, task, frame, depth, fd count, payload length (varints)
+// Fds ride along as SCM_RIGHTS on the first byte of the message.
+// Bump whenever the wire format changes in a way the other side can't
+// ignore. Anything optional should be a capability instead.
+static const uint32_t PIPE_MAGIC = 0x4b4c5256; // VRLK
+static const uint32_t PIPE_PROTOCOL_VERSION = 2;
+
+enum PipeMsgFlags : uint8_t {
+	// Nobody is waiting for the return, so don't send one
+	PIPE_MSG_DETACHED = 1 << 0,
+};
+
+// Handles with this bit set are promises for the result of a call that
+// hasn't run yet. The side running the calls resolves them, see fulfill.
+static const uint64_t PIPE_PROMISE_BIT = 1ull << 63;
+
+enum PipeCap : uint64_t {
+	// Frames can carry a fence for the dllhost to wait on
+	PIPE_CAP_FRAME_FENCE = 1ull << 0,
+	// A second connection for the frame critical methods
+	PIPE_CAP_PRIORITY_CHANNEL = 1ull << 1,
+};
+
+struct PipeHello {
+	uint32_t magic;
+	uint32_t version;
+	// Sizes of structs we send as raw bytes
+	uint32_t driverPoseSize;
+	uint32_t eventSize;
+	uint32_t submitLayerSize;
+	// Which slots the other side should hand out
+	uint32_t peerSlotParity;
+	uint64_t caps;
+};
+
+// Filled in with the openvr headers of whichever side we're built into
+void pipe_fill_hello(struct PipeHello *hello);
+
+static const size_t MaxHeaderSize = 2 + 5 + 10 + 10 + 5 + 5 + 10;
+static const size_t MaxMessageFds = 16;
+
+enum PipeExec : uint8_t {
+	// Runs on the logical thread of the caller
+	PIPE_EXEC_THREAD,
+	// Runs on the dispatcher, for short handlers
+	PIPE_EXEC_INLINE,
+};
+
+// A message for a thread that wasn't ready for it. The dispatcher reads it
+// off the channel so it can go on with the others.
+struct PipeMessage {
+	enum PipeMethod method;
+	uint8_t flags;
+	uint8_t channel;
+	uint32_t depth;
+	uint64_t task;
+	uint64_t frame;
+
+	std::vector<uint8_t> data;
+	size_t pos = 0;
+	std::vector<int> fds;
+	size_t fdPos = 0;
+};
+
+// The return of an async call. Only the thread that made the call can wait
+// for it.
+struct PipeFuture {
+	uint32_t slot;
+	uint64_t task;
 };
 
 struct Thread {
 	shim::thread thread;
 
 	enum PipeMethod method;
+	uint8_t flags;
+	// The task it's serving. Calls and their returns carry the same task
+	// number, and both processes tag their zones with it.
+	uint64_t task;
+	uint64_t frame;
+	// How many handlers deep the caller was
+	uint32_t depth;
+	// Which channel the task came in on. The rest of it is read from there
+	// and the return goes back the same way.
+	uint8_t channel;
 
 	Thread() {};
 	Thread (const Thread&) = delete;
@@ -95,28 +180,111 @@ struct Thread {
 	std::unique_ptr<std::condition_variable> cond = std::make_unique<std::condition_variable>();
 
 	bool pending = false;
+	// Non-zero while it's handling something, has something queued or is
+	// waiting on the other side
+	std::atomic<int> busy = 0;
+
+	// Set while the thread is parked. It takes the return of waitTask, and
+	// calls made by handlers at least waitDepth deep. Those are the ones
+	// made on behalf of what it's waiting for.
+	bool waiting = false;
+	uint64_t waitTask;
+	uint32_t waitDepth;
+	// Messages that came in while it was busy, or were for another wait.
+	// Guarded by lock.
+	std::deque<std::unique_ptr<struct PipeMessage>> queue;
 };
 
-class Pipe {
-	size_t allocate_task();
+enum PipeChannelId : uint8_t {
+	CHANNEL_NORMAL,
+	// Direct mode and poses. It has its own socket and dispatcher, so it
+	// never waits behind a big property batch or a burst of logs.
+	CHANNEL_PRIORITY,
+	CHANNEL_COUNT,
+};
 
-public:
-	FILE *read;
-	FILE *write;
-	FILE *log = nullptr;
+// One connection to the other side
+struct PipeChannel {
+	int fd = -1;
 
 	std::mutex writeLock;
 	std::mutex readLock;
 
-	std::vector<struct WaitSlot> wait;
-	ssize_t waitHead;
+	// Outgoing message, guarded by writeLock
+	enum PipeMethod outMethod;
+	uint8_t outFlags;
+	uint32_t outSlot;
+	uint64_t outTask;
+	uint32_t outDepth;
+	// The return of a detached call goes nowhere
+	bool outDiscard;
+	std::vector<uint8_t> out;
+	std::vector<int> outFds;
+
+	// Incoming bytes, guarded by readLock. We read as much as the socket
+	// has, so the small messages cost one syscall instead of one per field.
+	std::vector<uint8_t> rbuf;
+	size_t rpos = 0;
+	size_t rlen = 0;
+	std::vector<int> inFds;
+	size_t inFdPos = 0;
+	// What's left of the current message's payload
+	uint64_t inRemaining = 0;
+	uint64_t inFdCount = 0;
+
+	// io_uring to batch the detached sends if the kernel has it, everything
+	// else uses sendmsg and recvmsg directly
+	struct UringSender *tx = nullptr;
+};
+
+class Pipe {
+	struct PipeChannel channels[CHANNEL_COUNT];
+
+	uint32_t slotParity = 0;
+	std::atomic<uint32_t> nextSlot = 0;
+	std::mutex threadsLock;
+	std::vector<std::unique_ptr<struct Thread>> threads;
+
+	void *dispatchUserdata = nullptr;
+
+	// Results of calls made with a promise, keyed by the promise
+	std::mutex promisesLock;
+	std::condition_variable promisesCond;
+	std::map<uint64_t, uint64_t> promises;
+	std::map<uint64_t, uint64_t> promisedValues;
+	// Promises to forget along with a handle, see forget
+	std::multimap<uint64_t, uint64_t> promiseOwners;
+	std::atomic<uint64_t> nextPromise = 1;
+
+	void handshake(int sock, bool listener);
+	struct Thread *find_thread(uint32_t slot);
+	struct PipeChannel *channel_for(enum PipeMethod method);
+	bool dispatch_one(struct PipeChannel *channel, void *userdata, uint32_t waitSlot);
+	static void dispatch_channel(void *args);
+	void fill(struct PipeChannel *channel);
+	void read_raw(struct PipeChannel *channel, void *buf, size_t len);
+	uint64_t read_varint(struct PipeChannel *channel);
+	void flush(struct PipeChannel *channel);
+	bool flush_uring(struct PipeChannel *channel, struct iovec *iov, int iovCount, bool batch);
+	void attach_uring(struct PipeChannel *channel);
+	struct PipeMessage *read_message(struct PipeChannel *channel, enum PipeMethod method, uint8_t flags, uint32_t depth, uint64_t task, uint64_t frame);
+
+public:
+	FILE *log = nullptr;
 
 	Handler handler;
-	std::map<std::thread::id, struct Thread> threads;
 
 	std::vector<void *> objs;
 
-	size_t currentTask;
+	// What both ends support, settled in the handshake
+	uint64_t caps = 0;
+	bool has_cap(enum PipeCap cap) const { return (caps & cap) == cap; }
+
+	// Every call gets a task number. The frame number is bumped by the
+	// native side on Present and rides along with every message, so calls
+	// on either side can be matched to a frame.
+	std::atomic<uint64_t> nextTask = 0;
+	std::atomic<uint64_t> frame = 0;
 
 	// Eventually
 	// public:
@@ -127,6 +295,9 @@ public:
 
 	void msg(const char *format, ...);
 
+	struct Thread *lookup_thread(uint32_t slot, void *userdata, bool adopt);
+	struct PipeChannel *get_channel(uint8_t id) { return &channels[id]; }
+
 	// Recv Thread
 
 	// This also gives you the read channel, such that you can read the
@@ -140,6 +311,10 @@ public:
 	// read channel
 	void return_from_call(size_t taskId);
 
+	// The handler is done writing return values. Sends them off and lets go
+	// of the write channel
+	void end_return();
+
 	// Others
 
 	// Begin a call to a remote method. Takes ownership over the write channel
@@ -152,11 +327,49 @@ public:
 	// Returns the read channel to the Recv Thread
 	void return_read_channel();
 
+	// Signals the end of the arguments like wait_for_return, but doesn't
+	// wait. The thread can make other calls and wait for the returns in any
+	// order. Every future has to be waited for.
+	struct PipeFuture send_async();
+
+	// Waits for the return of an async call. Read the return values and
+	// give the read channel back like after wait_for_return
+	void wait_for(struct PipeFuture future);
+
+	// Signals the end of the arguments for a call we don't want anything
+	// back from. The other side skips sending the return.
+	void send_detached();
+
+	// Promise pipelining. The caller makes up a promise for a handle the
+	// call will return, sends it with the call and can use it in later calls
+	// right away. The side running the call fulfills it, and resolves the
+	// promise when it's passed back in. A failed call rejects its promise
+	// with the invalid handle, so users of it fail the way the real handle
+	// would. A promise that's never settled resolves to invalid too.
+	uint64_t new_promise() { return nextPromise++ | PIPE_PROMISE_BIT; }
+	// owner is the handle the value lives in, like a component's container
+	void fulfill(uint64_t promise, uint64_t value, uint64_t owner = 0);
+	void reject(uint64_t promise, uint64_t invalid, uint64_t owner = 0);
+	uint64_t resolve(uint64_t handle, uint64_t invalid);
+	// Drops the promises for a handle that went away, and for everything it
+	// owns
+	void forget(uint64_t value);
+	// The other way around, for handles we pass back to the caller
+	uint64_t promise_of(uint64_t value);
+
 	// Generic send and recieve methods. Requires you to own the respective
 	// channel
 	void send(const void* buf, size_t len);
 	void recv(void* buf, size_t max_len);
 
+	// LEB128, small numbers take a single byte
+	void send_varint(uint64_t value);
+	uint64_t recv_varint();
+
+	// Object handles are small indices into objs
+	void send_handle(uint64_t handle) { send_varint(handle); }
+	uint64_t recv_handle() { return recv_varint(); }
+
 	void send_new_obj(void* obj);
 
 	void send_fd(int fd);
@@ -0,0 +1,26 @@
+#include "shm.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+void *shm_create(const char *name, size_t len, int *fd) {
+	*fd = memfd_create(name, MFD_CLOEXEC);
+	if(*fd == -1) return nullptr;
+
+	if(ftruncate(*fd, len) != 0) {
+		close(*fd);
+		return nullptr;
+	}
+
+	void *mem = shm_map(*fd, len);
+	if(mem == nullptr) {
+		close(*fd);
+	}
+	return mem;
+}
+
+void *shm_map(int fd, size_t len) {
+	void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mem == MAP_FAILED) return nullptr;
+	return mem;
+}
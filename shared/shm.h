@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// A slot for one writer to publish a small value that any number of readers
+// can pick up without ever taking a lock or touching the pipe. The writer
+// makes the sequence odd while it's writing, and a reader tries again if it
+// saw an odd sequence or the sequence moved while it was copying.
+template<size_t Size>
+struct SeqSlot {
+	static constexpr size_t Words = (Size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+	std::atomic<uint32_t> seq;
+	std::atomic<uint64_t> data[Words];
+
+	void publish(const void *value, size_t len) {
+		uint64_t words[Words] = {0};
+		__builtin_memcpy(words, value, len < Size ? len : Size);
+
+		uint32_t s = seq.load(std::memory_order_relaxed);
+		seq.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for(size_t i = 0; i < Words; i++) {
+			data[i].store(words[i], std::memory_order_relaxed);
+		}
+		seq.store(s + 2, std::memory_order_release);
+	}
+
+	// Returns false if nothing was ever published
+	bool read(void *value, size_t len) const {
+		uint64_t words[Words];
+		uint32_t before;
+		while(true) {
+			before = seq.load(std::memory_order_acquire);
+			if(before & 1) continue;
+
+			for(size_t i = 0; i < Words; i++) {
+				words[i] = data[i].load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if(seq.load(std::memory_order_relaxed) == before) break;
+		}
+		if(before == 0) return false;
+
+		__builtin_memcpy(value, words, len < Size ? len : Size);
+		return true;
+	}
+};
+
+// Where the dllhost publishes the driver's DriverDirectMode_FrameTiming after
+// each frame
+typedef SeqSlot<64> FrameTimingSlot;
+
+// Memfd backed memory that can be handed to the other side with send_fd
+void *shm_create(const char *name, size_t len, int *fd);
+void *shm_map(int fd, size_t len);
@@ -0,0 +1,260 @@
+#include "uring.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static unsigned load_acquire(unsigned *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(unsigned *p, unsigned value) {
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+bool uring_init(struct Uring *ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = sys_setup(entries, &params);
+	if(ring->fd < 0) return false;
+
+	// Both rings go in one mapping, see uring_supported for the rest
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(ring->fd);
+		ring->fd = -1;
+		return false;
+	}
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(ring->cqRingSize > ring->sqRingSize) ring->sqRingSize = ring->cqRingSize;
+	ring->cqRingSize = ring->sqRingSize;
+
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sqRing == MAP_FAILED) {
+		close(ring->fd);
+		ring->fd = -1;
+		return false;
+	}
+	// Both rings share the mapping
+	ring->cqRing = ring->sqRing;
+
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) {
+		munmap(ring->sqRing, ring->sqRingSize);
+		close(ring->fd);
+		ring->fd = -1;
+		return false;
+	}
+
+	uint8_t *sq = (uint8_t*)ring->sqRing;
+	ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+	ring->sqLocalTail = *ring->sqTail;
+	ring->sqSubmitted = ring->sqLocalTail;
+
+	uint8_t *cq = (uint8_t*)ring->cqRing;
+	ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	return true;
+}
+
+void uring_destroy(struct Uring *ring) {
+	if(ring->fd < 0) return;
+	munmap(ring->sqes, ring->sqesSize);
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct Uring *ring) {
+	unsigned head = load_acquire(ring->sqHead);
+	if(ring->sqLocalTail - head > *ring->sqMask) return nullptr;
+
+	unsigned index = ring->sqLocalTail & *ring->sqMask;
+	ring->sqArray[index] = index;
+	ring->sqLocalTail++;
+
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+unsigned uring_queued(struct Uring *ring) {
+	return ring->sqLocalTail - ring->sqSubmitted;
+}
+
+int uring_submit(struct Uring *ring, unsigned waitFor) {
+	unsigned toSubmit = uring_queued(ring);
+	store_release(ring->sqTail, ring->sqLocalTail);
+	ring->sqSubmitted = ring->sqLocalTail;
+
+	unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+	while(true) {
+		int ret = sys_enter(ring->fd, toSubmit, waitFor, flags);
+		if(ret >= 0) return ret;
+		if(errno != EINTR) return -errno;
+		// Whatever got in before the signal is in
+		toSubmit = 0;
+	}
+}
+
+struct io_uring_cqe *uring_peek(struct Uring *ring) {
+	unsigned head = *ring->cqHead;
+	if(head == load_acquire(ring->cqTail)) return nullptr;
+	return &ring->cqes[head & *ring->cqMask];
+}
+
+void uring_seen(struct Uring *ring) {
+	store_release(ring->cqHead, *ring->cqHead + 1);
+}
+
+bool uring_sender_init(struct UringSender *sender) {
+	if(!uring_init(&sender->ring, UringEntries)) return false;
+
+	sender->buf = (uint8_t*)mmap(NULL, UringSendSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(sender->buf == MAP_FAILED) {
+		uring_destroy(&sender->ring);
+		return false;
+	}
+	return true;
+}
+
+// A message with fds goes out with sendmsg, the msghdr lives in the send
+// buffer right after the payload
+struct SendMsg {
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int) * UringMaxFds)];
+};
+
+bool uring_sender_queue(struct UringSender *sender, int fd, const struct iovec *iov, int iovCount, const int *fds, size_t fdCount) {
+	size_t len = 0;
+	for(int i = 0; i < iovCount; i++) len += iov[i].iov_len;
+	if(sender->used + len + 16 + sizeof(struct SendMsg) > UringSendSize) return false;
+
+	uint8_t *data = sender->buf + sender->used;
+	uint8_t *dst = data;
+	for(int i = 0; i < iovCount; i++) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+	sender->used += len;
+
+	// Runs of plain messages sit back to back in the buffer, so they go out
+	// as one send
+	struct io_uring_sqe *last = sender->last;
+	if(fdCount == 0 && last != nullptr && last->opcode == IORING_OP_SEND && last->addr + last->len == (uint64_t)(uintptr_t)data) {
+		last->len += len;
+		last->user_data += len;
+		return true;
+	}
+
+	struct io_uring_sqe *sqe = uring_get_sqe(&sender->ring);
+	if(sqe == nullptr) {
+		sender->used = data - sender->buf;
+		return false;
+	}
+
+	sqe->fd = fd;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	if(fdCount == 0) {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uint64_t)(uintptr_t)data;
+		sqe->len = len;
+	} else {
+		assert(fdCount <= UringMaxFds);
+		sender->used = (sender->used + 15) & ~(size_t)15;
+		struct SendMsg *send = (struct SendMsg*)(sender->buf + sender->used);
+		sender->used += sizeof(struct SendMsg);
+		memset(send, 0, sizeof(*send));
+		send->iov.iov_base = data;
+		send->iov.iov_len = len;
+		send->msg.msg_iov = &send->iov;
+		send->msg.msg_iovlen = 1;
+		send->msg.msg_control = send->control;
+		send->msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&send->msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+		sqe->len = 1;
+	}
+	// What a complete send returns
+	sqe->user_data = len;
+	// The stream has to go out in order. The link is cut again on the last
+	// one when we submit.
+	sqe->flags = IOSQE_IO_LINK;
+	sender->last = sqe;
+	sender->queued++;
+	return true;
+}
+
+bool uring_sender_flush(struct UringSender *sender) {
+	if(sender->queued == 0) return true;
+
+	sender->last->flags &= ~IOSQE_IO_LINK;
+	unsigned queued = sender->queued;
+	int ret = uring_submit(&sender->ring, queued);
+	bool ok = ret >= 0;
+
+	// Everything has to come back before the buffer can be used again. A
+	// failed link cancels the rest, they still complete
+	unsigned done = 0;
+	while(done < queued) {
+		struct io_uring_cqe *cqe = uring_peek(&sender->ring);
+		if(cqe == nullptr) {
+			int ret = uring_submit(&sender->ring, 1);
+			if(ret < 0 && ret != -EBUSY) return false;
+			continue;
+		}
+		if(cqe->res < 0 || (uint64_t)cqe->res != cqe->user_data) ok = false;
+		uring_seen(&sender->ring);
+		done++;
+	}
+
+	sender->used = 0;
+	sender->queued = 0;
+	sender->last = nullptr;
+	return ok;
+}
+
+// The linked sends only keep the stream in order if a short send breaks
+// the link, which they do once they honour MSG_WAITALL in 6.0. Nothing
+// tells us that short of filling a socket, so we go by the version.
+bool uring_supported() {
+	static std::once_flag once;
+	static bool supported;
+	std::call_once(once, [] {
+		struct utsname name;
+		unsigned major = 0, minor = 0;
+		if(uname(&name) != 0 || sscanf(name.release, "%u.%u", &major, &minor) != 2) return;
+		supported = major >= 6;
+	});
+	return supported;
+}
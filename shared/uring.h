@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+// Just enough io_uring for the pipe, straight on top of the syscalls so we
+// don't need liburing on either side. It's only there to batch sends, a
+// lone send or recv is just as cheap as the plain syscall. One ring per
+// channel, only ever touched under the channel's write lock.
+
+static const unsigned UringEntries = 64;
+static const size_t UringSendSize = 256 * 1024;
+// Same as MaxMessageFds in ipc.h
+static const size_t UringMaxFds = 16;
+
+struct Uring {
+	int fd = -1;
+
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	struct io_uring_sqe *sqes;
+	// Queued but not submitted yet
+	unsigned sqLocalTail;
+	unsigned sqSubmitted;
+
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+
+	void *sqRing = nullptr;
+	size_t sqRingSize;
+	void *cqRing = nullptr;
+	size_t cqRingSize;
+	size_t sqesSize;
+};
+
+// Whether the kernel does everything the sender and receiver need. Checked
+// once, the answer is the same for every channel.
+bool uring_supported();
+bool uring_init(struct Uring *ring, unsigned entries);
+void uring_destroy(struct Uring *ring);
+// Returns nullptr if the queue is full
+struct io_uring_sqe *uring_get_sqe(struct Uring *ring);
+unsigned uring_queued(struct Uring *ring);
+// Submits everything queued and waits until at least waitFor have completed
+int uring_submit(struct Uring *ring, unsigned waitFor);
+struct io_uring_cqe *uring_peek(struct Uring *ring);
+void uring_seen(struct Uring *ring);
+
+// Sending side of a channel. Messages are put together in one buffer.
+// Detached calls from a handler wait there and go out with the handler's
+// return in one submit. Plain sends can't use registered buffers, only the
+// zerocopy ones can and unix sockets don't do zerocopy.
+struct UringSender {
+	struct Uring ring;
+	uint8_t *buf = nullptr;
+	size_t used = 0;
+	// What each queued send has to come back with
+	unsigned queued = 0;
+	struct io_uring_sqe *last = nullptr;
+};
+
+bool uring_sender_init(struct UringSender *sender);
+// Queues one message. Returns false if it doesn't fit, flush and try again
+bool uring_sender_queue(struct UringSender *sender, int fd, const struct iovec *iov, int iovCount, const int *fds, size_t fdCount);
+// Sends everything queued and waits for it. Returns false if the socket
+// wouldn't take it all.
+bool uring_sender_flush(struct UringSender *sender);
@@ -0,0 +1,131 @@
+#include "dmabuf_format.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <libdrm/drm_fourcc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Stands in for vrserver's resource manager, it only knows about dmabufs
+class FakeResourceManager : public IVRIPCResourceManagerClient2 {
+public:
+	std::vector<uint32_t> formats;
+	std::vector<uint64_t> modifiers;
+
+	virtual bool NewSharedVulkanImage( uint32_t, uint32_t, uint32_t, bool, bool, bool, uint32_t, uint32_t, vr::SharedTextureHandle_t * ) { return false; }
+	virtual bool NewSharedVulkanBuffer( uint32_t, uint32_t, vr::SharedTextureHandle_t * ) { return false; }
+	virtual bool NewSharedVulkanSemaphore( vr::SharedTextureHandle_t * ) { return false; }
+	virtual bool RefResource( vr::SharedTextureHandle_t, uint64_t * ) { return false; }
+	virtual bool UnrefResource( vr::SharedTextureHandle_t ) { return false; }
+	virtual bool GetDmabufFormats( uint32_t *pOutFormatCount, uint32_t *pOutFormats ) {
+		return fill(formats, pOutFormatCount, pOutFormats);
+	}
+	virtual bool GetDmabufModifiers( vr::EVRApplicationType, uint32_t, uint32_t *pOutModifierCount, uint64_t *pOutModifiers ) {
+		return fill(modifiers, pOutModifierCount, pOutModifiers);
+	}
+	virtual bool ImportDmabuf( vr::EVRApplicationType, DmabufAttributes_t *, vr::SharedTextureHandle_t * ) { return false; }
+	virtual bool ReceiveSharedFd( uint64_t, int * ) { return false; }
+
+private:
+	// Same as vrserver, a null array asks for the count
+	template<typename T>
+	static bool fill(const std::vector<T> &from, uint32_t *count, T *out) {
+		if(out != nullptr) {
+			if(*count < from.size()) return false;
+			memcpy(out, from.data(), from.size() * sizeof(T));
+		}
+		*count = from.size();
+		return true;
+	}
+};
+
+// Made up AMD tiling modifiers, only their order matters
+static const uint64_t TILED = 0x0200000000000001;
+static const uint64_t TILED_DCC = 0x0200000000000002;
+
+static void test_formats() {
+	// Both sRGB and UNORM land on the same fourcc
+	assert(swap_format_from_vk(43)->drmFormat == DRM_FORMAT_ABGR8888);
+	assert(swap_format_from_vk(37)->drmFormat == DRM_FORMAT_ABGR8888);
+	assert(swap_format_from_vk(64)->drmFormat == DRM_FORMAT_ABGR2101010);
+	assert(swap_format_from_vk(97)->bytesPerPixel == 8);
+	assert(swap_format_from_vk(0) == nullptr);
+}
+
+static void test_negotiate() {
+	FakeResourceManager resMan;
+	std::vector<uint64_t> modifiers;
+
+	// Can't import the format at all
+	resMan.formats = {DRM_FORMAT_ARGB8888};
+	resMan.modifiers = {DRM_FORMAT_MOD_LINEAR};
+	assert(!negotiate_modifiers(&resMan, DRM_FORMAT_ABGR8888, &modifiers));
+
+	// Linear goes last, invalid goes away, the rest keeps vrserver's order
+	resMan.formats = {DRM_FORMAT_ARGB8888, DRM_FORMAT_ABGR8888};
+	resMan.modifiers = {DRM_FORMAT_MOD_LINEAR, TILED_DCC, DRM_FORMAT_MOD_INVALID, TILED};
+	assert(negotiate_modifiers(&resMan, DRM_FORMAT_ABGR8888, &modifiers));
+	assert((modifiers == std::vector<uint64_t>{TILED_DCC, TILED, DRM_FORMAT_MOD_LINEAR}));
+
+	// Nothing left to offer
+	resMan.modifiers = {DRM_FORMAT_MOD_INVALID};
+	assert(!negotiate_modifiers(&resMan, DRM_FORMAT_ABGR8888, &modifiers));
+	assert(modifiers.empty());
+}
+
+// memfds take the place of the dmabufs, the attributes only look at the size
+static int fake_dmabuf(size_t size) {
+	int fd = memfd_create("fake-dmabuf", MFD_CLOEXEC);
+	assert(fd != -1);
+	assert(ftruncate(fd, size) == 0);
+	return fd;
+}
+
+static void test_attributes() {
+	const struct SwapFormat *format = swap_format_from_vk(43);
+	struct DmabufAttributes_t dma;
+
+	int fd = fake_dmabuf(64 * 4 * 32);
+	struct DmabufPlane_t linear = { .unOffset = 0, .unStride = 64 * 4, .nFd = fd };
+	assert(dmabuf_attributes(format, 64, 32, DRM_FORMAT_MOD_LINEAR, 1, &linear, &dma));
+	assert(dma.unFormat == DRM_FORMAT_ABGR8888);
+	assert(dma.ulModifier == DRM_FORMAT_MOD_LINEAR);
+	assert(dma.unPlaneCount == 1 && dma.plane[0].nFd == fd);
+
+	// Too small for the rows, or the stride doesn't hold a row
+	assert(!dmabuf_attributes(format, 64, 33, DRM_FORMAT_MOD_LINEAR, 1, &linear, &dma));
+	struct DmabufPlane_t narrow = { .unOffset = 0, .unStride = 63 * 4, .nFd = fd };
+	assert(!dmabuf_attributes(format, 64, 32, DRM_FORMAT_MOD_LINEAR, 1, &narrow, &dma));
+	close(fd);
+
+	// A main and a compression plane in one allocation
+	fd = fake_dmabuf(1 << 20);
+	struct DmabufPlane_t planes[MaxDmabufPlaneCount + 1];
+	planes[0] = { .unOffset = 0, .unStride = 256, .nFd = fd };
+	planes[1] = { .unOffset = 1 << 19, .unStride = 64, .nFd = fd };
+	assert(dmabuf_attributes(format, 64, 32, TILED_DCC, 2, planes, &dma));
+	assert(dma.unPlaneCount == 2);
+	assert(dma.plane[1].unOffset == 1 << 19 && dma.plane[1].unStride == 64);
+
+	// Linear can't have a second plane, and the planes have to be in the buffer
+	assert(!dmabuf_attributes(format, 64, 32, DRM_FORMAT_MOD_LINEAR, 2, planes, &dma));
+	planes[1].unOffset = 1 << 20;
+	assert(!dmabuf_attributes(format, 64, 32, TILED_DCC, 2, planes, &dma));
+
+	// Plane count has to fit the import
+	for(uint32_t i = 0; i < MaxDmabufPlaneCount + 1; i++) planes[i] = planes[0];
+	assert(dmabuf_attributes(format, 64, 32, TILED_DCC, MaxDmabufPlaneCount, planes, &dma));
+	assert(!dmabuf_attributes(format, 64, 32, TILED_DCC, MaxDmabufPlaneCount + 1, planes, &dma));
+	assert(!dmabuf_attributes(format, 64, 32, TILED_DCC, 0, planes, &dma));
+	assert(!dmabuf_attributes(format, 64, 32, DRM_FORMAT_MOD_INVALID, 1, planes, &dma));
+	close(fd);
+}
+
+int main() {
+	test_formats();
+	test_negotiate();
+	test_attributes();
+	printf("dmabuf_format: ok\n");
+	return 0;
+}
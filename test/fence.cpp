@@ -0,0 +1,64 @@
+#include "fence.h"
+
+#include <cassert>
+#include <cstdio>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+// No GPU here, so everything runs on the eventfd stand-ins
+
+static void test_signal() {
+	int fence = fence_create(false);
+	assert(fence != -1);
+	assert(!fence_wait(fence, 0));
+	fence_signal(fence);
+	assert(fence_wait(fence, 0));
+	// Stays signalled
+	assert(fence_wait(fence, 0));
+	close(fence);
+
+	fence = fence_create(true);
+	assert(fence_wait(fence, 0));
+	close(fence);
+}
+
+static void test_wait_thread() {
+	int fence = fence_create(false);
+	std::thread signaller([&] {
+		usleep(10 * 1000);
+		fence_signal(fence);
+	});
+	assert(fence_wait(fence, -1));
+	signaller.join();
+	close(fence);
+}
+
+static void test_wait_all() {
+	int fences[3] = {fence_create(true), fence_create(false), fence_create(true)};
+	assert(!fence_wait_all(fences, 3, 10));
+	fence_signal(fences[1]);
+	assert(fence_wait_all(fences, 3, 10));
+	assert(fence_wait_all(fences, 0, 0));
+	for(int fence : fences) close(fence);
+}
+
+static void test_export_fallback() {
+	// Not a dmabuf, so the export can't work and we get a signalled stand-in
+	int buf = memfd_create("fence-test", MFD_CLOEXEC);
+	assert(buf != -1);
+	int fence = fence_export(buf);
+	assert(fence != -1);
+	assert(fence_wait(fence, 0));
+	close(fence);
+	close(buf);
+}
+
+int main() {
+	test_signal();
+	test_wait_thread();
+	test_wait_all();
+	test_export_fallback();
+	printf("fence: ok\n");
+	return 0;
+}